@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# How fast long lists are copied, by list length and pool size, to show
+# where copying on the pool starts to pay off (LPOOL_MIN in lval.h).
+#
+# Every time a symbol bound to a list is looked up, the list is copied, so
+# this binds one and looks it up over and over, copying about 2^22 elements
+# in all for each length.  The time for the same script without the lookups
+# is taken off, leaving the copies and the freeing that follows them.
+#
+# Lists are only copied on the pool when the build sets LPOOL_MIN, so
+# compare one built with it against the pool sizes, or against one built
+# without it:
+#
+#     cc -O2 -std=c99 -DLPOOL_MIN=4096 ... -o build/mylisp-pool
+#     bench/copy.sh build/mylisp-pool
+#
+# Usage: bench/copy.sh [mylisp] [threads ...]
+#
+# The threads default to 1, 2 and 4.  For each length and pool size it
+# prints the nanoseconds per element copied, and how many times faster that
+# is than on one thread.
+
+mylisp=${1:-build/mylisp}
+[ $# -gt 0 ] && shift
+threads=${*:-1 2 4}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+total=$((1 << 22))
+
+# Run a script, and print how long it took in nanoseconds
+run() {
+	start=$(date +%s%N)
+	MYLISP_THREADS=$1 "$mylisp" "$2" >/dev/null || exit 1
+	end=$(date +%s%N)
+	echo $((end - start))
+}
+
+printf '%8s %8s %10s %8s\n' length threads ns/elem speedup
+for bits in 12 13 14 15 16 17 18 19; do
+	n=$((1 << bits))
+	lookups=$((total / n))
+
+	# Start with a list of one small element, and double it
+	{
+		echo '(set (quote l) (quote ((1 "one" (x 1.5)))))'
+		i=0
+		while [ $i -lt $bits ]; do
+			echo '(set (quote l) (join l l))'
+			i=$((i + 1))
+		done
+	} >"$dir/build.lisp"
+	cp "$dir/build.lisp" "$dir/copy.lisp"
+	i=0
+	while [ $i -lt $lookups ]; do
+		echo '(length l)'
+		i=$((i + 1))
+	done >>"$dir/copy.lisp"
+
+	one=
+	for t in $threads; do
+		base=$(run "$t" "$dir/build.lisp")
+		time=$(run "$t" "$dir/copy.lisp")
+		ns=$(((time - base) / total))
+		[ -z "$one" ] && one=$ns
+		awk -v n="$n" -v t="$t" -v ns="$ns" -v one="$one" 'BEGIN {
+			printf "%8d %8d %10d %8.2f\n", n, t, ns,
+				(ns > 0 ? one / ns : 0)
+		}'
+	done
+done
@@ -11,6 +11,15 @@ struct lval *builtin_car(struct lenv *env, struct lval *args)
 {
 	/* TODO(jfriedly):  Make this return NIL on 0 args */
 	LASSERT_ARGC(args, 1, "car");
+	if (args->cell[0]->type == LVAL_VECTOR) {
+		struct lval *v = args->cell[0];
+		LASSERT(args, v->val.vec.start < v->val.vec.vec->count,
+			"Function car passed an empty vector.");
+		struct lval *x = lval_copy(lvec_nth(v->val.vec.vec,
+			v->val.vec.start));
+		lval_del(args);
+		return x;
+	}
 	LASSERT_TYPE(args->cell[0], LVAL_SEXPR, "car");
 	debug("car passed type");
 
@@ -30,6 +39,13 @@ struct lval *builtin_cdr(struct lenv *env, struct lval *args)
 {
 	/* TODO(jfriedly):  Make this return NIL on 0 args */
 	LASSERT_ARGC(args, 1, "cdr");
+	if (args->cell[0]->type == LVAL_VECTOR) {
+		/* The rest of a vector is a view of the same vector */
+		struct lval *v = lval_take(args, 0);
+		if (v->val.vec.start < v->val.vec.vec->count)
+			v->val.vec.start++;
+		return v;
+	}
 	LASSERT_TYPE(args->cell[0], LVAL_SEXPR, "cdr");
 
 	/* Otherwise take the first argument */
@@ -103,6 +119,26 @@ bool _convert_to_bool(struct lval *v)
 		if (!v->val.b)
 			return false;
 		break;
+	case LVAL_PORT:
+		break;
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		if (v->val.str.len == 0)
+			return false;
+		break;
+	case LVAL_HASHMAP:
+		if (lhash_count(v->val.hash) == 0)
+			return false;
+		break;
+	case LVAL_VECTOR:
+		if (v->val.vec.start == v->val.vec.vec->count)
+			return false;
+		break;
+	case LVAL_ISOLATE:
+	case LVAL_FUTURE:
+	case LVAL_CHANNEL:
+	case LVAL_TASK:
+		break;
 	}
 
 	debug("_convert_to_bool returning true");
@@ -190,8 +226,16 @@ struct lval *builtin_length(struct lenv *env, struct lval *args)
 {
 	/* Otherwise take the first argument */
 	struct lval *arg1 = lval_take(args, 0);
-	debug("builtin_length returning an lval_long of %d", arg1->count);
-	return lval_long(arg1->count);
+	long len = arg1->count;
+	if (arg1->type == LVAL_STRING || arg1->type == LVAL_BYTES)
+		len = arg1->val.str.len;
+	else if (arg1->type == LVAL_HASHMAP)
+		len = lhash_count(arg1->val.hash);
+	else if (arg1->type == LVAL_VECTOR)
+		len = arg1->val.vec.vec->count - arg1->val.vec.start;
+	lval_del(arg1);
+	debug("builtin_length returning an lval_long of %ld", len);
+	return lval_long(len);
 }
 
 /* Common code used by both builtin_let and builtin_set */
@@ -227,17 +271,65 @@ struct lval *builtin_env(struct lenv *env, struct lval *args)
 	return lval_sexpr();
 }
 
+/* Whether exit can end the process from this thread */
+static __thread bool lval_exit_allowed;
+/* How the error exit returns anywhere else starts */
+#define LVAL_EXITED "Function exit ended the evaluation"
+
 struct lval *builtin_exit(struct lenv *env, struct lval *args)
 {
-	printf("Bye.\n");
-	exit(0);
+	LASSERT(args, args->count <= 1,
+		"Function exit passed incorrect number of arguments.  "
+		"Got %d.  Expected 0 or 1.", args->count);
+	int status = 0;
+	if (args->count == 1) {
+		LASSERT(args, args->cell[0]->type == LVAL_LONG,
+			"Function exit passed incorrect type.  Got %s.  "
+			"Expected %s.", ltype(args->cell[0]->type),
+			ltype(LVAL_LONG));
+		status = args->cell[0]->val.num_long;
+	}
+	lval_del(args);
+	/* exit flushes stdout, which is fully buffered in batch mode */
+	if (lval_exit_allowed && !ltask_inside())
+		exit(status);
+	return lval_err(LVAL_EXITED " with status %d.", status);
+}
+
+bool lval_allow_exit(bool allow)
+{
+	bool prev = lval_exit_allowed;
+	lval_exit_allowed = allow;
+	return prev;
+}
+
+bool lval_exited(struct lval *v)
+{
+	return v->type == LVAL_ERR &&
+		strncmp(v->val.err, LVAL_EXITED, strlen(LVAL_EXITED)) == 0;
 }
 
 struct lval *lval_call(struct lenv *env, struct lval *f, struct lval *args)
 {
-	/* If it's a builtin function, evaluate it directly */
-	if (f->val.func.builtin)
-		return f->val.func.builtin(env, args);
+	/* Make some headway on any long lists that were dropped */
+	lfree_step();
+
+	/*
+	 * If it's a builtin function, evaluate it directly, but not once the
+	 * quota's passed, which it might do itself by allocating too much
+	 */
+	if (f->val.func.builtin) {
+		if (lquota_over()) {
+			lval_del(args);
+			return lquota_err();
+		}
+		struct lval *result = f->val.func.builtin(env, args);
+		if (lquota_over()) {
+			lval_del(result);
+			return lquota_err();
+		}
+		return result;
+	}
 
 	int argc = args->count;
 	int total = f->val.func.formals->count;
@@ -365,6 +457,11 @@ struct lval *lval_eval_sexpr(struct lenv *env, struct lval *sexpr)
 
 struct lval *lval_eval(struct lenv *env, struct lval *v)
 {
+	/* Once the quota's passed, unwind like for any other error */
+	if (!lquota_step()) {
+		lval_del(v);
+		return lquota_err();
+	}
 	/* Look up symbols in the environment */
 	if (v->type == LVAL_SYM) {
 		struct lval *x = lenv_get(env, v);
@@ -74,9 +74,20 @@ struct lval *builtin_let(struct lenv *env, struct lval *args);
 struct lval *builtin_set(struct lenv *env, struct lval *args);
 /* Prints all variables in the environment */
 struct lval *builtin_env(struct lenv *env, struct lval *args);
-/* Exits the REPL */
+/*
+ * Exits the interpreter, with an optional status.  That's only on a thread
+ * that's called lval_allow_exit, outside any task:  anywhere else, such as
+ * in a future, an isolate or a server's client, it ends the evaluation with
+ * an error instead.
+ */
 struct lval *builtin_exit(struct lenv *env, struct lval *args);
+/* Set whether exit can end the process from this thread, returning the old */
+bool lval_allow_exit(bool allow);
+/* Whether an error is the one exit returns when it can't end the process */
+bool lval_exited(struct lval *v);
 
+/* Call a function with a list of arguments, consuming the arguments */
+struct lval *lval_call(struct lenv *env, struct lval *f, struct lval *args);
 /* Evaluate an S-expression */
 struct lval *lval_eval_sexpr(struct lenv *env, struct lval *sexpr);
 /*
@@ -123,4 +134,167 @@ struct lval *builtin_leq(struct lenv *env, struct lval *numbers);
 struct lval *builtin_g(struct lenv *env, struct lval *numbers);
 struct lval *builtin_l(struct lenv *env, struct lval *numbers);
 
+/****************************************************************************
+ * Functions below here are defined in lprint.c
+ ***************************************************************************/
+
+/* Returns the printed form of an lval as a string */
+struct lval *builtin_to_string(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lstring.c
+ ***************************************************************************/
+
+/* Returns the bytes of a string or bytes from start up to end */
+struct lval *builtin_substring(struct lenv *env, struct lval *args);
+/* Joins strings, or bytes, end to end */
+struct lval *builtin_concat(struct lenv *env, struct lval *args);
+/* Returns the bytes of a string */
+struct lval *builtin_to_bytes(struct lenv *env, struct lval *args);
+/* Returns the byte at an index of a string or bytes, as an integer */
+struct lval *builtin_byte_at(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lhash.c
+ ***************************************************************************/
+
+/* Creates a hash map from alternating keys and values */
+struct lval *builtin_hashmap(struct lenv *env, struct lval *args);
+/* Looks up a key in a hash map, returning a default or () if it's missing */
+struct lval *builtin_get(struct lenv *env, struct lval *args);
+/* Binds a key to a value in a hash map, and returns the map */
+struct lval *builtin_put(struct lenv *env, struct lval *args);
+/* Removes a key from a hash map, and returns the map */
+struct lval *builtin_remove(struct lenv *env, struct lval *args);
+/* Returns whether a hash map has a key */
+struct lval *builtin_has(struct lenv *env, struct lval *args);
+/* Returns a list of the (key value) pairs in a hash map */
+struct lval *builtin_entries(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lvec.c
+ ***************************************************************************/
+
+/* Creates a vector of its arguments */
+struct lval *builtin_vector(struct lenv *env, struct lval *args);
+/* Returns a vector with more elements appended */
+struct lval *builtin_conj(struct lenv *env, struct lval *args);
+/* Returns a vector with the element at an index replaced */
+struct lval *builtin_assoc(struct lenv *env, struct lval *args);
+/* Returns the element of a vector at an index */
+struct lval *builtin_nth(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lserial.c
+ ***************************************************************************/
+
+/* Writes a value to a file in the binary format */
+struct lval *builtin_dump(struct lenv *env, struct lval *args);
+/* Reads back a value written by dump */
+struct lval *builtin_load_binary(struct lenv *env, struct lval *args);
+/* Writes the whole global environment to an image file */
+struct lval *builtin_save_image(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lload.c
+ ***************************************************************************/
+
+/* Evaluates every form in a source file */
+struct lval *builtin_load(struct lenv *env, struct lval *args);
+/* Returns the number of source cache hits and misses */
+struct lval *builtin_cache_stats(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lport.c
+ ***************************************************************************/
+
+/* Opens a port on a file, for reading (r), writing (w) or appending (a) */
+struct lval *builtin_open(struct lenv *env, struct lval *args);
+/* Reads a line from a port as a string, or returns () at EOF */
+struct lval *builtin_read_line(struct lenv *env, struct lval *args);
+/* Reads up to n bytes from a port as bytes, or returns () at EOF */
+struct lval *builtin_read_bytes(struct lenv *env, struct lval *args);
+/* Writes a value to a port */
+struct lval *builtin_write(struct lenv *env, struct lval *args);
+/* Writes out anything buffered for a port */
+struct lval *builtin_flush(struct lenv *env, struct lval *args);
+/* Flushes and closes a port, or closes a channel */
+struct lval *builtin_close(struct lenv *env, struct lval *args);
+/* Returns the ports at the (read write) ends of a new pipe */
+struct lval *builtin_pipe(struct lenv *env, struct lval *args);
+/* Returns a port listening on a Unix domain socket */
+struct lval *builtin_listen(struct lenv *env, struct lval *args);
+/* Waits for a connection on a listening port, and returns (in out) ports */
+struct lval *builtin_accept(struct lenv *env, struct lval *args);
+/* Connects to a Unix domain socket, and returns (in out) ports */
+struct lval *builtin_connect(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lisolate.c
+ ***************************************************************************/
+
+/* Starts running a script in a new isolate, with the rest as its argv */
+struct lval *builtin_isolate(struct lenv *env, struct lval *args);
+/* Waits for an isolate to finish and returns a copy of its result */
+struct lval *builtin_isolate_join(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lfuture.c
+ ***************************************************************************/
+
+/* Starts evaluating an expression in the background */
+struct lval *builtin_future(struct lenv *env, struct lval *args);
+/* Waits for a future and returns its value */
+struct lval *builtin_touch(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lchan.c
+ ***************************************************************************/
+
+/* Creates a channel with room for n values */
+struct lval *builtin_channel(struct lenv *env, struct lval *args);
+/* Sends a value on a channel, waiting while it's full */
+struct lval *builtin_send(struct lenv *env, struct lval *args);
+/* Receives a value from a channel, waiting while it's empty */
+struct lval *builtin_recv(struct lenv *env, struct lval *args);
+/* Receives a value from a channel as a one element list, or returns () */
+struct lval *builtin_try_recv(struct lenv *env, struct lval *args);
+/* Receives from whichever of several channels has a value first */
+struct lval *builtin_select(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in ltask.c
+ ***************************************************************************/
+
+/* Starts a task that calls a function with the rest of the arguments */
+struct lval *builtin_spawn(struct lenv *env, struct lval *args);
+/* Lets the other tasks on this thread run */
+struct lval *builtin_yield(struct lenv *env, struct lval *args);
+/* Runs tasks until one has finished, and returns its value */
+struct lval *builtin_wait(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in levent.c
+ ***************************************************************************/
+
+/* Waits for some milliseconds, letting other tasks run */
+struct lval *builtin_sleep(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lpool.c
+ ***************************************************************************/
+
+/* Applies a function to every element of a list in parallel, in order */
+struct lval *builtin_pmap(struct lenv *env, struct lval *args);
+
+/****************************************************************************
+ * Functions below here are defined in lfree.c
+ ***************************************************************************/
+
+/*
+ * Returns the number of lists freed a slice at a time, and a histogram of
+ * how long the slices took
+ */
+struct lval *builtin_free_stats(struct lenv *env, struct lval *args);
+
 #endif
@@ -0,0 +1,37 @@
+#include <stdio.h>
+
+#include "mpc.h"
+
+/*
+ * Print reader_tables.h, the precompiled regex tables used by reader.c.
+ *
+ * Rebuild and rerun this whenever the reader's regexes change:
+ *
+ *     cc -std=c99 -Wall genreader.c mpc.c -lm -o build/genreader
+ *     ./build/genreader > reader_tables.h
+ */
+
+/* Keep these in sync with the grammar in reader.c */
+static const char *number_re = "-?[0-9.]+";
+static const char *symbol_re = "[a-zA-Z0-9_+\\-*/\\\\=<>!%^&]+";
+/* The runs of characters between escapes in a string literal */
+static const char *string_chars_re = "[^\"\\\\]+";
+
+int main(int argc, char **argv)
+{
+	puts("/* Generated by genreader.c.  Do not edit. */");
+	puts("#ifndef reader_tables_h");
+	puts("#define reader_tables_h");
+	puts("");
+	if (!mpc_dfa_print("reader_number", number_re))
+		return 1;
+	puts("");
+	if (!mpc_dfa_print("reader_symbol", symbol_re))
+		return 1;
+	puts("");
+	if (!mpc_dfa_print("reader_string_chars", string_chars_re))
+		return 1;
+	puts("");
+	puts("#endif");
+	return 0;
+}
@@ -0,0 +1,386 @@
+/* pthreads are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Channels are bounded multi-producer, multi-consumer queues, after Dmitry
+ * Vyukov's.  Every cell has a sequence number saying whose turn it is:  a
+ * sender may fill the cell for position pos once its sequence is pos, and a
+ * receiver may empty it once it's pos + 1.  Senders and receivers claim
+ * positions with a compare and swap on enq or deq, so neither ever takes a
+ * lock to move a value.  Values move by pointer, so sending one doesn't
+ * copy it.
+ *
+ * The lock and list of waiters are only for sleeping.  A task (or thread)
+ * that finds the channel full (or empty) puts a waiter on the list and
+ * checks again under the lock before it waits, and every send, receive and
+ * close signals the waiters if there are any, so no wakeup is lost.  Tasks
+ * park while they wait, and are woken on their own thread through its event
+ * loop, so the rest of its tasks carry on meanwhile.
+ */
+/* Keep the ends on separate cache lines, since they're hammered by threads */
+#define LCHAN_LINE 64
+
+struct lchan_cell {
+	size_t seq;
+	struct lval *v;
+};
+
+struct lchan {
+	int refs;
+	size_t mask;
+	bool closed;
+	/* How many are waiting, so senders and receivers can skip the lock */
+	int waiters;
+	pthread_mutex_t lock;
+	struct levent_waiter *waiting;
+	char pad0[LCHAN_LINE];
+	size_t enq;
+	char pad1[LCHAN_LINE];
+	size_t deq;
+	char pad2[LCHAN_LINE];
+	struct lchan_cell cells[];
+};
+
+/* select waits on every channel at once, so it has its own list */
+static pthread_mutex_t lchan_select_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct levent_waiter *lchan_select_waiting;
+static int lchan_select_waiters;
+
+struct lchan *lchan_new(size_t cap)
+{
+	/* With one cell, a full channel's sequence looks like an empty one's */
+	size_t n = 2;
+	while (n < cap)
+		n *= 2;
+
+	struct lchan *ch = malloc(sizeof(struct lchan) +
+		n * sizeof(struct lchan_cell));
+	ch->refs = 1;
+	ch->mask = n - 1;
+	ch->closed = false;
+	ch->waiters = 0;
+	pthread_mutex_init(&ch->lock, NULL);
+	ch->waiting = NULL;
+	ch->enq = 0;
+	ch->deq = 0;
+	for (size_t i = 0; i < n; i++) {
+		ch->cells[i].seq = i;
+		ch->cells[i].v = NULL;
+	}
+	return ch;
+}
+
+void lchan_retain(struct lchan *ch)
+{
+	LREF_RETAIN(ch->refs);
+}
+
+static bool lchan_pop(struct lchan *ch, struct lval **v);
+
+void lchan_release(struct lchan *ch)
+{
+	if (LREF_RELEASE(ch->refs) > 0)
+		return;
+	struct lval *v;
+	while (lchan_pop(ch, &v))
+		lval_del(v);
+	pthread_mutex_destroy(&ch->lock);
+	free(ch);
+}
+
+static bool lchan_push(struct lchan *ch, struct lval *v)
+{
+	size_t pos = __atomic_load_n(&ch->enq, __ATOMIC_RELAXED);
+	struct lchan_cell *cell;
+	for (;;) {
+		cell = &ch->cells[pos & ch->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ch->enq, &pos, pos + 1,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Full */
+			return false;
+		} else {
+			pos = __atomic_load_n(&ch->enq, __ATOMIC_RELAXED);
+		}
+	}
+	cell->v = v;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool lchan_pop(struct lchan *ch, struct lval **v)
+{
+	size_t pos = __atomic_load_n(&ch->deq, __ATOMIC_RELAXED);
+	struct lchan_cell *cell;
+	for (;;) {
+		cell = &ch->cells[pos & ch->mask];
+		size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ch->deq, &pos, pos + 1,
+				true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			/* Empty */
+			return false;
+		} else {
+			pos = __atomic_load_n(&ch->deq, __ATOMIC_RELAXED);
+		}
+	}
+	*v = cell->v;
+	cell->v = NULL;
+	__atomic_store_n(&cell->seq, pos + ch->mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* Whether a send would find the channel full, or a receive find it empty */
+static bool lchan_full(struct lchan *ch)
+{
+	size_t pos = __atomic_load_n(&ch->enq, __ATOMIC_ACQUIRE);
+	size_t seq = __atomic_load_n(&ch->cells[pos & ch->mask].seq,
+		__ATOMIC_ACQUIRE);
+	return seq != pos;
+}
+
+static bool lchan_empty(struct lchan *ch)
+{
+	size_t pos = __atomic_load_n(&ch->deq, __ATOMIC_ACQUIRE);
+	size_t seq = __atomic_load_n(&ch->cells[pos & ch->mask].seq,
+		__ATOMIC_ACQUIRE);
+	return seq != pos + 1;
+}
+
+static bool lchan_closed(struct lchan *ch)
+{
+	return __atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Put a waiter for the running task on a list, before checking whether it
+ * needs to wait.  Called with the list's lock held.
+ */
+static struct levent_waiter *lchan_enlist(struct levent_waiter **list,
+	int *count)
+{
+	struct levent_waiter *w = levent_waiter_new();
+	levent_enlist(list, w);
+	__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return w;
+}
+
+/* Take a waiter off its list again, if it didn't need to wait after all */
+static void lchan_delist(struct levent_waiter **list, int *count,
+	struct levent_waiter *w)
+{
+	levent_delist(list, w);
+	__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Signal and empty a list of waiters.  Called with its lock held. */
+static void lchan_wake(struct levent_waiter **list, int *count)
+{
+	levent_signal_all(*list);
+	*list = NULL;
+	__atomic_store_n(count, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Wake anything waiting on a channel that's just changed */
+static void lchan_notify(struct lchan *ch)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ch->waiters, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&ch->lock);
+		lchan_wake(&ch->waiting, &ch->waiters);
+		pthread_mutex_unlock(&ch->lock);
+	}
+	if (__atomic_load_n(&lchan_select_waiters, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_lock(&lchan_select_lock);
+		lchan_wake(&lchan_select_waiting, &lchan_select_waiters);
+		pthread_mutex_unlock(&lchan_select_lock);
+	}
+}
+
+/*
+ * Wait until a channel might have room (or a value) or is closed.  Returns
+ * false if the quota's deadline passed first.
+ */
+static bool lchan_wait(struct lchan *ch, bool (*blocked)(struct lchan *ch))
+{
+	pthread_mutex_lock(&ch->lock);
+	struct levent_waiter *w = lchan_enlist(&ch->waiting, &ch->waiters);
+	bool wait = blocked(ch) && !lchan_closed(ch);
+	if (!wait)
+		lchan_delist(&ch->waiting, &ch->waiters, w);
+	pthread_mutex_unlock(&ch->lock);
+
+	bool ok = !wait || levent_await(w, &ch->lock, &ch->waiting,
+		&ch->waiters);
+	levent_waiter_free(w);
+	return ok;
+}
+
+bool lchan_send(struct lchan *ch, struct lval *v)
+{
+	for (;;) {
+		if (lchan_closed(ch))
+			return false;
+		if (lchan_push(ch, v))
+			break;
+		if (!lchan_wait(ch, lchan_full))
+			return false;
+	}
+	lchan_notify(ch);
+	return true;
+}
+
+struct lval *lchan_recv(struct lchan *ch, bool block)
+{
+	struct lval *v;
+	for (;;) {
+		/* Anything sent before the close is still received */
+		bool closed = lchan_closed(ch);
+		if (lchan_pop(ch, &v))
+			break;
+		if (closed || !block || !lchan_wait(ch, lchan_empty))
+			return NULL;
+	}
+	lchan_notify(ch);
+	return v;
+}
+
+void lchan_close(struct lchan *ch)
+{
+	__atomic_store_n(&ch->closed, true, __ATOMIC_RELEASE);
+	lchan_notify(ch);
+}
+
+#define LASSERT_CHANNEL(args, i, func_name) \
+	LASSERT(args, args->cell[i]->type == LVAL_CHANNEL, \
+		"Function %s passed incorrect type.  Got %s.  " \
+		"Expected %s.", func_name, ltype(args->cell[i]->type), \
+		ltype(LVAL_CHANNEL));
+
+struct lval *builtin_channel(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "channel");
+	LASSERT(args, args->cell[0]->type == LVAL_LONG &&
+		args->cell[0]->val.num_long > 0 &&
+		args->cell[0]->val.num_long <= (1L << 24),
+		"Function channel needs a capacity from 1 to %ld.", 1L << 24);
+
+	struct lchan *ch = lchan_new(args->cell[0]->val.num_long);
+	lval_del(args);
+	return lval_channel(ch);
+}
+
+struct lval *builtin_send(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "send");
+	LASSERT_CHANNEL(args, 0, "send");
+
+	/* The value moves into the channel rather than being copied */
+	struct lval *v = lval_pop(args, 1);
+	if (!lchan_send(args->cell[0]->val.chan, v)) {
+		lval_del(v);
+		LASSERT(args, false, "Function send passed a closed channel.");
+	}
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_recv(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "recv");
+	LASSERT_CHANNEL(args, 0, "recv");
+
+	struct lval *v = lchan_recv(args->cell[0]->val.chan, true);
+	lval_del(args);
+	return v != NULL ? v : lval_sexpr();
+}
+
+struct lval *builtin_try_recv(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "try-recv");
+	LASSERT_CHANNEL(args, 0, "try-recv");
+
+	struct lval *v = lchan_recv(args->cell[0]->val.chan, false);
+	lval_del(args);
+	struct lval *result = lval_sexpr();
+	return v != NULL ? lval_append(result, v) : result;
+}
+
+/*
+ * Try to receive from each channel in turn, without waking anything.
+ * Returns the index of the one that had a value, or -1, setting *open to
+ * whether any are still open.
+ */
+static int lchan_select_once(struct lval *args, struct lval **v, bool *open)
+{
+	*open = false;
+	for (int i = 0; i < args->count; i++) {
+		struct lchan *ch = args->cell[i]->val.chan;
+		*open = *open || !lchan_closed(ch);
+		if (lchan_pop(ch, v))
+			return i;
+	}
+	return -1;
+}
+
+struct lval *builtin_select(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count > 0,
+		"Function select passed incorrect number of arguments.  "
+		"Got 0.  Expected at least 1.");
+	for (int i = 0; i < args->count; i++)
+		LASSERT_CHANNEL(args, i, "select");
+
+	struct lval *v;
+	bool open;
+	int i = lchan_select_once(args, &v, &open);
+	while (i < 0 && open) {
+		pthread_mutex_lock(&lchan_select_lock);
+		struct levent_waiter *w = lchan_enlist(&lchan_select_waiting,
+			&lchan_select_waiters);
+		i = lchan_select_once(args, &v, &open);
+		bool wait = i < 0 && open;
+		if (!wait)
+			lchan_delist(&lchan_select_waiting,
+				&lchan_select_waiters, w);
+		pthread_mutex_unlock(&lchan_select_lock);
+
+		bool ok = !wait || levent_await(w, &lchan_select_lock,
+			&lchan_select_waiting, &lchan_select_waiters);
+		levent_waiter_free(w);
+		/* lval_call gives the quota's error in place of the () */
+		if (!ok)
+			break;
+		if (wait)
+			i = lchan_select_once(args, &v, &open);
+	}
+
+	/* (index value), or () once every channel is closed and empty */
+	struct lval *result = lval_sexpr();
+	if (i >= 0) {
+		lchan_notify(args->cell[i]->val.chan);
+		result = lval_append(result, lval_long(i));
+		result = lval_append(result, v);
+	}
+	lval_del(args);
+	return result;
+}
@@ -0,0 +1,564 @@
+/* epoll and eventfd are Linux, and clock_gettime is POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Each thread has an event loop, for tasks waiting on pipes, sockets and
+ * timers.  A task that would block is parked instead, with a waiter on the
+ * file descriptor or in the timer heap, and the scheduler polls the loop
+ * whenever it runs, putting tasks back on the run queue once they're ready.
+ * When there's nothing else to run, it blocks in epoll_wait until the
+ * first one is.
+ *
+ * Code that isn't in a task waits the same way, but runs the scheduler
+ * until its waiter is ready, so the thread's tasks carry on meanwhile.
+ *
+ * Other threads can wake a waiter too, for things like channels.  They put
+ * it on the list of signalled waiters for the thread it's on and write to
+ * that thread's eventfd, which is registered with its epoll, and the thread
+ * wakes it the next time it polls.
+ *
+ * Nothing waits past the deadline of the quota it's evaluating under, if
+ * there is one.  The waiter gets a timer for it too, and if that goes off
+ * first, the waiter's taken off whatever it was waiting on and woken with
+ * expired set, so the evaluation can stop with the quota's error.
+ */
+
+/* Events handled for each call to epoll_wait */
+#define LEVENT_BATCH 64
+/* The place in the timer heap of a waiter without a timer */
+#define LEVENT_UNTIMED SIZE_MAX
+
+struct levent_waiter {
+	/* The parked task, or NULL if the waiter is running the scheduler */
+	struct ltask *task;
+	bool ready;
+	/* Set if it was woken by its quota's deadline */
+	bool expired;
+	/* Set once levent_signal's wakeup for it has arrived */
+	bool signalled;
+	struct levent_waiter *next;
+	/* The loop of the thread it waits on, for levent_signal */
+	struct levent_loop *loop;
+	/* The descriptor it waits on, or -1, and whether it's to write */
+	int fd;
+	bool write;
+	/* Its place in the timer heap, and whether that's for the deadline */
+	size_t timer;
+	bool deadline;
+};
+
+/* What another thread needs to wake this one's waiters */
+struct levent_loop {
+	pthread_mutex_t lock;
+	/* Waiters signalled since the thread last polled, newest first */
+	struct levent_waiter *signalled;
+	/* An eventfd that's readable while there are any */
+	int fd;
+};
+
+/* Everything waiting on one file descriptor */
+struct levent_fd {
+	struct levent_waiter *readers;
+	struct levent_waiter *writers;
+	/* The events it's registered with epoll for */
+	uint32_t events;
+};
+
+struct levent_timer {
+	/* When it goes off, in milliseconds on the monotonic clock */
+	long long deadline;
+	struct levent_waiter *waiter;
+};
+
+static __thread int levent_epoll = -1;
+static __thread struct levent_loop *levent_loop;
+/* Indexed by file descriptor, and grown to fit the highest one */
+static __thread struct levent_fd *levent_fds;
+static __thread int levent_nfds;
+/* A binary heap, with the next timer to go off first */
+static __thread struct levent_timer *levent_timers;
+static __thread size_t levent_ntimers;
+static __thread size_t levent_timers_cap;
+/* Waiters that haven't been woken yet */
+static __thread int levent_waiting;
+
+static long long levent_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void levent_timer_remove(struct levent_waiter *w);
+
+/* Wake a waiter, putting its task back on the run queue */
+static void levent_wake(struct levent_waiter *w)
+{
+	if (w->timer != LEVENT_UNTIMED)
+		levent_timer_remove(w);
+	w->ready = true;
+	levent_waiting--;
+	if (w->task != NULL)
+		ltask_wake(w->task);
+}
+
+/* Wake a list of waiters */
+static void levent_fire(struct levent_waiter *w)
+{
+	while (w != NULL) {
+		struct levent_waiter *next = w->next;
+		levent_wake(w);
+		w = next;
+	}
+}
+
+/* Create the thread's epoll instance if it hasn't got one yet */
+static bool levent_init(void)
+{
+	if (levent_epoll < 0)
+		levent_epoll = epoll_create1(EPOLL_CLOEXEC);
+	return levent_epoll >= 0;
+}
+
+/* Wake the waiters other threads have signalled, in the order they were */
+static void levent_drain(void)
+{
+	uint64_t n;
+	if (read(levent_loop->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		log_err("Could not read the event loop's eventfd");
+
+	pthread_mutex_lock(&levent_loop->lock);
+	struct levent_waiter *w = levent_loop->signalled;
+	levent_loop->signalled = NULL;
+	pthread_mutex_unlock(&levent_loop->lock);
+
+	struct levent_waiter *oldest = NULL;
+	while (w != NULL) {
+		struct levent_waiter *next = w->next;
+		w->next = oldest;
+		oldest = w;
+		w = next;
+	}
+	while (oldest != NULL) {
+		struct levent_waiter *next = oldest->next;
+		oldest->signalled = true;
+		/* Unless its deadline already woke it */
+		if (!oldest->ready)
+			levent_wake(oldest);
+		oldest = next;
+	}
+}
+
+/*
+ * Register a file descriptor with epoll for the events its waiters want.
+ * Returns false and sets errno if it can't be, such as for a regular file.
+ */
+static bool levent_update(int fd)
+{
+	struct levent_fd *e = &levent_fds[fd];
+	uint32_t events = (e->readers != NULL ? EPOLLIN : 0) |
+		(e->writers != NULL ? EPOLLOUT : 0);
+	if (events == e->events)
+		return true;
+
+	struct epoll_event ev = { .events = events, .data.fd = fd };
+	int op = e->events == 0 ? EPOLL_CTL_ADD :
+		events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	int status = epoll_ctl(levent_epoll, op, fd, &ev);
+	/* A closed descriptor leaves epoll, and its number can be reused */
+	if (status != 0 && errno == ENOENT && op == EPOLL_CTL_MOD)
+		status = epoll_ctl(levent_epoll, EPOLL_CTL_ADD, fd, &ev);
+	else if (status != 0 && errno == EEXIST)
+		status = epoll_ctl(levent_epoll, EPOLL_CTL_MOD, fd, &ev);
+	if (status != 0 && op != EPOLL_CTL_DEL)
+		return false;
+	e->events = events;
+	return true;
+}
+
+/* Waiters keep track of their place in the heap, so they can leave it */
+static void levent_timer_swap(size_t i, size_t j)
+{
+	struct levent_timer tmp = levent_timers[i];
+	levent_timers[i] = levent_timers[j];
+	levent_timers[j] = tmp;
+	levent_timers[i].waiter->timer = i;
+	levent_timers[j].waiter->timer = j;
+}
+
+static void levent_timer_up(size_t i)
+{
+	while (i > 0 && levent_timers[(i - 1) / 2].deadline >
+		levent_timers[i].deadline) {
+		levent_timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void levent_timer_down(size_t i)
+{
+	for (;;) {
+		size_t min = i;
+		size_t l = 2 * i + 1;
+		size_t r = l + 1;
+		if (l < levent_ntimers &&
+			levent_timers[l].deadline < levent_timers[min].deadline)
+			min = l;
+		if (r < levent_ntimers &&
+			levent_timers[r].deadline < levent_timers[min].deadline)
+			min = r;
+		if (min == i)
+			break;
+		levent_timer_swap(i, min);
+		i = min;
+	}
+}
+
+static void levent_timer_push(long long deadline, struct levent_waiter *w)
+{
+	if (levent_ntimers == levent_timers_cap) {
+		levent_timers_cap = levent_ntimers ? levent_ntimers * 2 : 16;
+		levent_timers = realloc(levent_timers,
+			sizeof(struct levent_timer) * levent_timers_cap);
+	}
+	size_t i = levent_ntimers++;
+	levent_timers[i].deadline = deadline;
+	levent_timers[i].waiter = w;
+	w->timer = i;
+	levent_timer_up(i);
+}
+
+static void levent_timer_remove(struct levent_waiter *w)
+{
+	size_t i = w->timer;
+	w->timer = LEVENT_UNTIMED;
+	levent_timers[i] = levent_timers[--levent_ntimers];
+	if (i < levent_ntimers) {
+		struct levent_waiter *moved = levent_timers[i].waiter;
+		moved->timer = i;
+		levent_timer_up(i);
+		levent_timer_down(moved->timer);
+	}
+}
+
+/*
+ * Take a waiter whose deadline has passed off the descriptor it's waiting
+ * on.  Anything else it's waiting on is up to whoever's waiting.
+ */
+static void levent_expire(struct levent_waiter *w)
+{
+	w->expired = true;
+	if (w->fd >= 0) {
+		struct levent_fd *e = &levent_fds[w->fd];
+		levent_delist(w->write ? &e->writers : &e->readers, w);
+		levent_update(w->fd);
+	}
+}
+
+bool levent_busy(void)
+{
+	return levent_waiting > 0;
+}
+
+void levent_poll(int timeout)
+{
+	if (levent_waiting == 0)
+		return;
+
+	/* Don't sleep past the next timer */
+	if (levent_ntimers > 0) {
+		long long left = levent_timers[0].deadline - levent_now();
+		if (left < 0)
+			left = 0;
+		if (timeout < 0 || left < timeout)
+			timeout = left;
+	}
+
+	struct epoll_event evs[LEVENT_BATCH];
+	int n = 0;
+	if (levent_epoll >= 0) {
+		n = epoll_wait(levent_epoll, evs, LEVENT_BATCH, timeout);
+	} else if (timeout != 0) {
+		/* Only timers are waiting */
+		poll(NULL, 0, timeout);
+	}
+
+	for (int i = 0; i < n; i++) {
+		int fd = evs[i].data.fd;
+		if (levent_loop != NULL && fd == levent_loop->fd) {
+			levent_drain();
+			continue;
+		}
+		struct levent_fd *e = &levent_fds[fd];
+		uint32_t failed = EPOLLERR | EPOLLHUP;
+		if (evs[i].events & (EPOLLIN | failed)) {
+			struct levent_waiter *w = e->readers;
+			e->readers = NULL;
+			levent_fire(w);
+		}
+		if (evs[i].events & (EPOLLOUT | failed)) {
+			struct levent_waiter *w = e->writers;
+			e->writers = NULL;
+			levent_fire(w);
+		}
+		levent_update(fd);
+	}
+
+	long long now = levent_now();
+	while (levent_ntimers > 0 && levent_timers[0].deadline <= now) {
+		struct levent_waiter *w = levent_timers[0].waiter;
+		if (w->deadline)
+			levent_expire(w);
+		levent_wake(w);
+	}
+}
+
+/* Not on the stack, which is copied away while the task is parked */
+static struct levent_waiter *levent_waiter_alloc(void)
+{
+	struct levent_waiter *w = malloc(sizeof(struct levent_waiter));
+	w->task = ltask_self();
+	w->ready = false;
+	w->expired = false;
+	w->signalled = false;
+	w->next = NULL;
+	w->loop = NULL;
+	w->fd = -1;
+	w->write = false;
+	w->timer = LEVENT_UNTIMED;
+	w->deadline = false;
+	return w;
+}
+
+/* Wait for a waiter to be woken, with the scheduler running meanwhile */
+static void levent_park(struct levent_waiter *w)
+{
+	levent_waiting++;
+	if (w->task != NULL) {
+		ltask_park();
+		return;
+	}
+	while (!w->ready)
+		ltask_idle(-1);
+}
+
+/*
+ * Wait for a waiter to be woken, or until the time given (if it isn't 0),
+ * but not past the quota's deadline.  Returns false if that came first.
+ */
+static bool levent_block(struct levent_waiter *w, long long until)
+{
+	long long deadline = lquota_deadline();
+	if (deadline > 0 && (until == 0 || deadline < until)) {
+		w->deadline = true;
+		levent_timer_push(deadline, w);
+	} else if (until > 0) {
+		levent_timer_push(until, w);
+	}
+	levent_park(w);
+	if (!w->expired)
+		return true;
+	/* So the quota knows it's passed */
+	lquota_check();
+	return false;
+}
+
+bool levent_wait(int fd, bool write)
+{
+	if (!levent_init())
+		return false;
+	if (fd >= levent_nfds) {
+		int n = levent_nfds > 0 ? levent_nfds : 64;
+		while (n <= fd)
+			n *= 2;
+		levent_fds = realloc(levent_fds, sizeof(struct levent_fd) * n);
+		memset(levent_fds + levent_nfds, 0,
+			sizeof(struct levent_fd) * (n - levent_nfds));
+		levent_nfds = n;
+	}
+
+	struct levent_waiter *w = levent_waiter_alloc();
+	w->fd = fd;
+	w->write = write;
+	struct levent_fd *e = &levent_fds[fd];
+	struct levent_waiter **list = write ? &e->writers : &e->readers;
+	w->next = *list;
+	*list = w;
+
+	if (!levent_update(fd)) {
+		int saved = errno;
+		*list = w->next;
+		free(w);
+		/* Regular files are always ready */
+		errno = saved;
+		return errno == EPERM;
+	}
+	bool ok = levent_block(w, 0);
+	free(w);
+	if (!ok)
+		errno = ETIMEDOUT;
+	return ok;
+}
+
+void levent_forget(int fd)
+{
+	if (fd >= levent_nfds)
+		return;
+	struct levent_fd *e = &levent_fds[fd];
+	struct levent_waiter *readers = e->readers;
+	struct levent_waiter *writers = e->writers;
+	e->readers = NULL;
+	e->writers = NULL;
+	levent_update(fd);
+	levent_fire(readers);
+	levent_fire(writers);
+}
+
+bool levent_sleep(long ms)
+{
+	struct levent_waiter *w = levent_waiter_alloc();
+	bool ok = levent_block(w, levent_now() + ms);
+	free(w);
+	return ok;
+}
+
+struct levent_waiter *levent_waiter_new(void)
+{
+	if (levent_loop == NULL) {
+		struct levent_loop *loop = malloc(sizeof(struct levent_loop));
+		pthread_mutex_init(&loop->lock, NULL);
+		loop->signalled = NULL;
+		loop->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = loop->fd };
+		if (loop->fd < 0 || !levent_init() ||
+			epoll_ctl(levent_epoll, EPOLL_CTL_ADD, loop->fd, &ev) != 0)
+			log_err("Could not set up the event loop for wakeups");
+		levent_loop = loop;
+	}
+
+	struct levent_waiter *w = levent_waiter_alloc();
+	w->loop = levent_loop;
+	return w;
+}
+
+bool levent_await(struct levent_waiter *w, pthread_mutex_t *lock,
+	struct levent_waiter **list, int *count)
+{
+	if (levent_block(w, 0))
+		return true;
+
+	pthread_mutex_lock(lock);
+	bool listed = levent_delist(list, w);
+	if (listed && count != NULL)
+		__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(lock);
+	/*
+	 * If it's not on the list, it's been signalled, and it can't be freed
+	 * until the signal arrives
+	 */
+	if (!listed && !w->signalled) {
+		w->ready = false;
+		levent_park(w);
+	}
+	return false;
+}
+
+void levent_waiter_free(struct levent_waiter *w)
+{
+	free(w);
+}
+
+void levent_signal(struct levent_waiter *w)
+{
+	struct levent_loop *loop = w->loop;
+	uint64_t one = 1;
+	pthread_mutex_lock(&loop->lock);
+	w->next = loop->signalled;
+	loop->signalled = w;
+	/*
+	 * Still under the lock, since once the waiter's thread can take it
+	 * off the list, it can go on to free it and exit
+	 */
+	if (write(loop->fd, &one, sizeof(one)) < 0)
+		log_err("Could not write to the event loop's eventfd");
+	pthread_mutex_unlock(&loop->lock);
+}
+
+void levent_enlist(struct levent_waiter **list, struct levent_waiter *w)
+{
+	w->next = *list;
+	*list = w;
+}
+
+bool levent_delist(struct levent_waiter **list, struct levent_waiter *w)
+{
+	for (; *list != NULL; list = &(*list)->next) {
+		if (*list == w) {
+			*list = w->next;
+			w->next = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+void levent_signal_all(struct levent_waiter *list)
+{
+	while (list != NULL) {
+		struct levent_waiter *next = list->next;
+		levent_signal(list);
+		list = next;
+	}
+}
+
+void levent_cleanup(void)
+{
+	if (levent_loop != NULL) {
+		/* Nobody can be signalling a waiter, since none are left */
+		close(levent_loop->fd);
+		pthread_mutex_destroy(&levent_loop->lock);
+		free(levent_loop);
+		levent_loop = NULL;
+	}
+	if (levent_epoll >= 0) {
+		close(levent_epoll);
+		levent_epoll = -1;
+	}
+	free(levent_fds);
+	levent_fds = NULL;
+	levent_nfds = 0;
+	free(levent_timers);
+	levent_timers = NULL;
+	levent_ntimers = 0;
+	levent_timers_cap = 0;
+}
+
+struct lval *builtin_sleep(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "sleep");
+	LASSERT(args, args->cell[0]->type == LVAL_LONG &&
+		args->cell[0]->val.num_long >= 0,
+		"Function sleep needs a number of milliseconds to sleep.");
+
+	bool ok = levent_sleep(args->cell[0]->val.num_long);
+	lval_del(args);
+	return ok ? lval_sexpr() : lquota_err();
+}
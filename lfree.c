@@ -0,0 +1,147 @@
+/* clock_gettime is POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Freeing a value takes as long as it is big, so dropping a list of a few
+ * million elements could stop a thread for a second, and every task and
+ * client on it with it.  Instead, lval_del sets long lists aside here, and
+ * they're freed a slice at a time:  one slice whenever a function is
+ * called, and more whenever the thread has nothing else to do.  A slice
+ * stops after MYLISP_PAUSE microseconds (1000 by default), so that's the
+ * longest anything waits on freeing.  Copying a long list frees as many
+ * elements as it copies too, so that a thread that keeps copying and
+ * dropping them frees them as fast as it makes them.
+ *
+ * A list that's set aside while another is being freed goes on top of it,
+ * and is finished first.  Ports in it are closed when freeing reaches them,
+ * since finding them any sooner would mean looking through the whole list.
+ * A thread that's about to end frees whatever it has left with lfree_drain.
+ */
+
+/* Elements freed between looks at the clock */
+#define LFREE_CHECK 32
+/* Microseconds in a slice, unless MYLISP_PAUSE says otherwise */
+#define LFREE_PAUSE 1000
+
+/* Every thread frees the lists it dropped */
+static __thread struct lval **lfree_pending;
+static __thread size_t lfree_count;
+static __thread size_t lfree_cap;
+
+/* In nanoseconds, or -1 until MYLISP_PAUSE has been read */
+static long long lfree_pause = -1;
+
+/* Lists set aside, and slices that took under 1, 2, 4 ... microseconds */
+static long lfree_lists;
+static long lfree_slices[LFREE_BUCKETS];
+
+static long long lfree_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long lfree_budget(void)
+{
+	long long pause = __atomic_load_n(&lfree_pause, __ATOMIC_RELAXED);
+	if (pause >= 0)
+		return pause;
+
+	pause = LFREE_PAUSE;
+	char *env = getenv("MYLISP_PAUSE");
+	if (env != NULL && *env != '\0')
+		pause = strtol(env, NULL, 10);
+	if (pause < 1)
+		pause = 1;
+	pause *= 1000;
+	__atomic_store_n(&lfree_pause, pause, __ATOMIC_RELAXED);
+	return pause;
+}
+
+void lfree_defer(struct lval *v)
+{
+	if (lfree_count == lfree_cap) {
+		lfree_cap = lfree_cap ? lfree_cap * 2 : 16;
+		lfree_pending = realloc(lfree_pending,
+			sizeof(struct lval *) * lfree_cap);
+	}
+	lfree_pending[lfree_count++] = v;
+	__atomic_add_fetch(&lfree_lists, 1, __ATOMIC_RELAXED);
+}
+
+/* Free the last element of the newest list set aside, or the list itself */
+static void lfree_one(void)
+{
+	struct lval *v = lfree_pending[lfree_count - 1];
+	if (v->count == 0) {
+		lfree_count--;
+		free(v->cell);
+		free(v);
+		return;
+	}
+	/* Taken off first, since freeing it can set aside another list */
+	lval_del(v->cell[--v->count]);
+}
+
+void lfree_pace(size_t n)
+{
+	while (n-- > 0 && lfree_count > 0)
+		lfree_one();
+}
+
+bool lfree_step(void)
+{
+	if (lfree_count == 0)
+		return false;
+
+	long long budget = lfree_budget();
+	long long start = lfree_now();
+	long long elapsed;
+	do {
+		for (int i = 0; i < LFREE_CHECK && lfree_count > 0; i++)
+			lfree_one();
+		elapsed = lfree_now() - start;
+	} while (lfree_count > 0 && elapsed < budget);
+
+	int bucket = 0;
+	while (bucket < LFREE_BUCKETS - 1 && elapsed >= 1000LL << bucket)
+		bucket++;
+	__atomic_add_fetch(&lfree_slices[bucket], 1, __ATOMIC_RELAXED);
+	return lfree_count > 0;
+}
+
+void lfree_drain(void)
+{
+	while (lfree_count > 0)
+		lfree_one();
+	free(lfree_pending);
+	lfree_pending = NULL;
+	lfree_cap = 0;
+}
+
+struct lval *builtin_free_stats(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 0, "free-stats");
+	lval_del(args);
+
+	struct lval *slices = lval_sexpr();
+	for (int i = 0; i < LFREE_BUCKETS; i++) {
+		long n = __atomic_load_n(&lfree_slices[i], __ATOMIC_RELAXED);
+		slices = lval_append(slices, lval_long(n));
+	}
+	struct lval *stats = lval_sexpr();
+	stats = lval_append(stats, lval_long(__atomic_load_n(&lfree_lists,
+		__ATOMIC_RELAXED)));
+	return lval_append(stats, slices);
+}
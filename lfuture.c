@@ -0,0 +1,148 @@
+/* pthreads are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * A future is an expression evaluated on a pool thread while the thread that
+ * made it carries on.  It's queued on the pool, and whichever thread gets to
+ * it first, a pool thread or one that touches it, evaluates it.  So touching
+ * a future that hasn't started yet never waits on a busy pool.
+ */
+enum {
+	LFUTURE_QUEUED,
+	LFUTURE_RUNNING,
+	LFUTURE_DONE,
+};
+
+struct lfuture {
+	int refs;
+	pthread_mutex_t lock;
+	int state;
+	/* What's waiting for it to be done */
+	struct levent_waiter *waiting;
+	/* A copy of every binding the expression could see, and itself */
+	struct lenv *env;
+	struct lval *expr;
+	struct lval *result;
+	/* The quota it was made under */
+	struct lquota *quota;
+};
+
+void lfuture_retain(struct lfuture *f)
+{
+	LREF_RETAIN(f->refs);
+}
+
+void lfuture_release(struct lfuture *f)
+{
+	if (LREF_RELEASE(f->refs) > 0)
+		return;
+	pthread_mutex_destroy(&f->lock);
+	if (f->env != NULL)
+		lenv_del(f->env);
+	if (f->expr != NULL)
+		lval_del(f->expr);
+	if (f->result != NULL)
+		lval_del(f->result);
+	lquota_release(f->quota);
+	free(f);
+}
+
+void lfuture_run(struct lfuture *f)
+{
+	pthread_mutex_lock(&f->lock);
+	bool claimed = f->state == LFUTURE_QUEUED;
+	if (claimed)
+		f->state = LFUTURE_RUNNING;
+	pthread_mutex_unlock(&f->lock);
+	if (!claimed)
+		return;
+
+	struct lquota *quota = lquota_swap(f->quota);
+	f->quota = NULL;
+	/* Even on a thread that touched it, exit only ends the future */
+	bool allowed = lval_allow_exit(false);
+	struct lval *result = lval_eval(f->env, f->expr);
+	lval_allow_exit(allowed);
+	f->expr = NULL;
+	lenv_del(f->env);
+	f->env = NULL;
+	lquota_release(lquota_swap(quota));
+
+	pthread_mutex_lock(&f->lock);
+	f->result = result;
+	f->state = LFUTURE_DONE;
+	levent_signal_all(f->waiting);
+	f->waiting = NULL;
+	pthread_mutex_unlock(&f->lock);
+}
+
+struct lval *builtin_future(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "future");
+
+	struct lfuture *f = malloc(sizeof(struct lfuture));
+	f->refs = 1;
+	pthread_mutex_init(&f->lock, NULL);
+	f->state = LFUTURE_QUEUED;
+	f->waiting = NULL;
+	/*
+	 * The thread that made the future can go on to set things or return
+	 * from the function it's in, so the future gets a copy of what it can
+	 * see rather than looking in the environments it was made in, though
+	 * only of the bindings its expression could look up.
+	 */
+	f->env = lenv_new();
+	f->env->isolated = true;
+	f->expr = lval_take(args, 0);
+	lenv_capture(f->env, env, NULL, f->expr);
+	f->result = NULL;
+	f->quota = lquota_get();
+	lquota_retain(f->quota);
+
+	/* With the queue full, it's quicker to do it now than to wait */
+	if (!lpool_submit(f))
+		lfuture_run(f);
+	return lval_future(f);
+}
+
+struct lval *builtin_touch(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "touch");
+	LASSERT(args, args->cell[0]->type == LVAL_FUTURE,
+		"Function touch passed incorrect type.  Got %s.  "
+		"Expected %s.", ltype(args->cell[0]->type),
+		ltype(LVAL_FUTURE));
+
+	struct lfuture *f = args->cell[0]->val.future;
+	lfuture_run(f);
+	/* A task parks until it's done, so the thread's other tasks can run */
+	pthread_mutex_lock(&f->lock);
+	struct levent_waiter *w = NULL;
+	if (f->state != LFUTURE_DONE) {
+		w = levent_waiter_new();
+		levent_enlist(&f->waiting, w);
+	}
+	pthread_mutex_unlock(&f->lock);
+	if (w != NULL) {
+		bool ok = levent_await(w, &f->lock, &f->waiting, NULL);
+		levent_waiter_free(w);
+		if (!ok) {
+			lval_del(args);
+			return lquota_err();
+		}
+	}
+
+	struct lval *result = lval_copy(f->result);
+	lval_del(args);
+	return result;
+}
@@ -0,0 +1,465 @@
+/* Recursive mutexes are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/* The smallest table, which must be a power of two like every table */
+#define LHASH_MIN 8
+/* How many slots of the old table each put or remove moves */
+#define LHASH_STEP 16
+
+/* Deleted slots point here, so probes carry on past them */
+static struct lval lhash_deleted;
+
+struct lhash *lhash_new(void)
+{
+	struct lhash *h = calloc(1, sizeof(struct lhash));
+	h->refs = 1;
+	/* Walking values can come back to a map while it's locked */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&h->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	return h;
+}
+
+void lhash_retain(struct lhash *h)
+{
+	LREF_RETAIN(h->refs);
+}
+
+static void lhash_table_del(struct lhash_table *t, size_t from)
+{
+	for (size_t i = from; i < t->cap; i++) {
+		struct lhash_entry *e = &t->slots[i];
+		if (e->key != NULL && e->key != &lhash_deleted) {
+			lval_del(e->key);
+			lval_del(e->val);
+		}
+	}
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+}
+
+void lhash_release(struct lhash *h)
+{
+	if (LREF_RELEASE(h->refs) > 0)
+		return;
+	lhash_table_del(&h->cur, 0);
+	lhash_table_del(&h->old, h->moved);
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+void lhash_lock(struct lhash *h)
+{
+	pthread_mutex_lock(&h->lock);
+}
+
+void lhash_unlock(struct lhash *h)
+{
+	pthread_mutex_unlock(&h->lock);
+}
+
+/* The finalizer from splitmix64, so that nearby keys land far apart */
+static uint64_t lhash_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/* 64 bit FNV-1a */
+static uint64_t lhash_bytes(const char *s, size_t n)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < n; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/* The bits of a double, with -0.0 counted as 0.0 since they're equal */
+static uint64_t lhash_double_bits(double x)
+{
+	uint64_t bits;
+	if (x == 0)
+		x = 0;
+	memcpy(&bits, &x, sizeof(bits));
+	return bits;
+}
+
+bool lhash_key(struct lval *k, uint64_t *hash)
+{
+	uint64_t h;
+
+	switch (k->type) {
+	case LVAL_LONG:
+		h = (uint64_t)k->val.num_long;
+		break;
+	case LVAL_DOUBLE:
+		h = lhash_double_bits(k->val.num_double);
+		break;
+	case LVAL_SYM:
+		h = lhash_bytes(k->val.sym, strlen(k->val.sym));
+		break;
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		h = lhash_bytes(LVAL_STR(k), k->val.str.len);
+		break;
+	case LVAL_BOOL:
+		h = k->val.b;
+		break;
+	default:
+		return false;
+	}
+	/* Mix in the type, since equal bits of different types differ */
+	*hash = lhash_mix(h ^ ((uint64_t)k->type << 56));
+	return true;
+}
+
+static bool lhash_equal(struct lval *x, struct lval *y)
+{
+	if (x->type != y->type)
+		return false;
+
+	switch (x->type) {
+	case LVAL_LONG:
+		return x->val.num_long == y->val.num_long;
+	case LVAL_DOUBLE:
+		return lhash_double_bits(x->val.num_double) ==
+			lhash_double_bits(y->val.num_double);
+	case LVAL_SYM:
+		return strcmp(x->val.sym, y->val.sym) == 0;
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		return x->val.str.len == y->val.str.len &&
+			memcmp(LVAL_STR(x), LVAL_STR(y), x->val.str.len) == 0;
+	case LVAL_BOOL:
+		return x->val.b == y->val.b;
+	}
+	return false;
+}
+
+/* Find the slot holding a key, or NULL */
+static struct lhash_entry *lhash_find(struct lhash_table *t, struct lval *k,
+	uint64_t hash)
+{
+	if (t->cap == 0)
+		return NULL;
+
+	/* There's always an empty slot, so this stops */
+	size_t mask = t->cap - 1;
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		struct lhash_entry *e = &t->slots[i];
+		if (e->key == NULL)
+			return NULL;
+		if (e->key != &lhash_deleted && e->hash == hash &&
+			lhash_equal(e->key, k))
+			return e;
+	}
+}
+
+/* Add a key that isn't already in the table, reusing a deleted slot */
+static void lhash_insert(struct lhash_table *t, struct lval *k, uint64_t hash,
+	struct lval *v)
+{
+	size_t mask = t->cap - 1;
+	size_t i = hash & mask;
+	while (t->slots[i].key != NULL && t->slots[i].key != &lhash_deleted)
+		i = (i + 1) & mask;
+	if (t->slots[i].key == NULL)
+		t->used++;
+	t->live++;
+	t->slots[i].hash = hash;
+	t->slots[i].key = k;
+	t->slots[i].val = v;
+}
+
+static void lhash_unlink(struct lhash_table *t, struct lhash_entry *e)
+{
+	e->key = &lhash_deleted;
+	e->val = NULL;
+	t->live--;
+}
+
+/* Move up to n slots of the old table into the current one */
+static void lhash_migrate(struct lhash *h, size_t n)
+{
+	struct lhash_table *old = &h->old;
+	if (old->cap == 0)
+		return;
+
+	for (; n > 0 && h->moved < old->cap; n--, h->moved++) {
+		struct lhash_entry *e = &old->slots[h->moved];
+		if (e->key != NULL && e->key != &lhash_deleted) {
+			lhash_insert(&h->cur, e->key, e->hash, e->val);
+			old->live--;
+		}
+	}
+	if (h->moved == old->cap) {
+		free(old->slots);
+		memset(old, 0, sizeof(*old));
+		h->moved = 0;
+	}
+}
+
+/*
+ * Start moving to a new table.  It's at least as big as the current one and
+ * at most 3/8 full once everything has moved, so it has room for everything
+ * still to move and at least as many new keys before it fills up in turn,
+ * by which time LHASH_STEP slots per put have emptied the old table.
+ */
+static void lhash_grow(struct lhash *h)
+{
+	/* Only happens if the old table was mostly deleted slots */
+	lhash_migrate(h, SIZE_MAX);
+
+	size_t live = h->cur.live;
+	size_t cap = h->cur.cap < LHASH_MIN ? LHASH_MIN : h->cur.cap;
+	while (cap * 3 < live * 8)
+		cap *= 2;
+
+	h->old = h->cur;
+	h->moved = 0;
+	lquota_alloc(sizeof(struct lhash_entry) * cap);
+	h->cur.slots = calloc(cap, sizeof(struct lhash_entry));
+	h->cur.cap = cap;
+	h->cur.live = 0;
+	h->cur.used = 0;
+	if (h->old.cap == 0) {
+		free(h->old.slots);
+		memset(&h->old, 0, sizeof(h->old));
+	}
+}
+
+/* Find a key in either table */
+static struct lhash_entry *lhash_lookup(struct lhash *h, struct lval *k,
+	uint64_t hash)
+{
+	struct lhash_entry *e = lhash_find(&h->cur, k, hash);
+	if (e == NULL)
+		e = lhash_find(&h->old, k, hash);
+	return e;
+}
+
+struct lval *lhash_get(struct lhash *h, struct lval *k, uint64_t hash)
+{
+	pthread_mutex_lock(&h->lock);
+	struct lhash_entry *e = lhash_lookup(h, k, hash);
+	/* Copied before a put on another thread can free it */
+	struct lval *v = e ? lval_copy(e->val) : NULL;
+	pthread_mutex_unlock(&h->lock);
+	return v;
+}
+
+bool lhash_has(struct lhash *h, struct lval *k, uint64_t hash)
+{
+	pthread_mutex_lock(&h->lock);
+	bool found = lhash_lookup(h, k, hash) != NULL;
+	pthread_mutex_unlock(&h->lock);
+	return found;
+}
+
+void lhash_put(struct lhash *h, struct lval *k, uint64_t hash,
+	struct lval *v)
+{
+	pthread_mutex_lock(&h->lock);
+	lhash_migrate(h, LHASH_STEP);
+
+	struct lhash_entry *e = lhash_find(&h->cur, k, hash);
+	if (e != NULL) {
+		lval_del(k);
+		lval_del(e->val);
+		e->val = v;
+		pthread_mutex_unlock(&h->lock);
+		return;
+	}
+
+	/* A key that hasn't moved yet moves now */
+	e = lhash_find(&h->old, k, hash);
+	if (e != NULL) {
+		lval_del(k);
+		lval_del(e->val);
+		k = e->key;
+		lhash_unlink(&h->old, e);
+	}
+
+	/* Keep the table at most 3/4 full */
+	if ((h->cur.used + 1) * 4 > h->cur.cap * 3)
+		lhash_grow(h);
+	lhash_insert(&h->cur, k, hash, v);
+	pthread_mutex_unlock(&h->lock);
+}
+
+bool lhash_remove(struct lhash *h, struct lval *k, uint64_t hash)
+{
+	pthread_mutex_lock(&h->lock);
+	lhash_migrate(h, LHASH_STEP);
+
+	struct lhash_table *t = &h->cur;
+	struct lhash_entry *e = lhash_find(t, k, hash);
+	if (e == NULL) {
+		t = &h->old;
+		e = lhash_find(t, k, hash);
+	}
+	if (e != NULL) {
+		lval_del(e->key);
+		lval_del(e->val);
+		lhash_unlink(t, e);
+	}
+	pthread_mutex_unlock(&h->lock);
+	return e != NULL;
+}
+
+size_t lhash_count(struct lhash *h)
+{
+	pthread_mutex_lock(&h->lock);
+	size_t count = h->cur.live + h->old.live;
+	pthread_mutex_unlock(&h->lock);
+	return count;
+}
+
+struct lhash_entry *lhash_next(struct lhash *h, size_t *i)
+{
+	/* The current table, then the old one from where moving is up to */
+	while (*i < h->cur.cap) {
+		struct lhash_entry *e = &h->cur.slots[(*i)++];
+		if (e->key != NULL && e->key != &lhash_deleted)
+			return e;
+	}
+	if (*i < h->cur.cap + h->moved)
+		*i = h->cur.cap + h->moved;
+	while (*i < h->cur.cap + h->old.cap) {
+		struct lhash_entry *e = &h->old.slots[(*i)++ - h->cur.cap];
+		if (e->key != NULL && e->key != &lhash_deleted)
+			return e;
+	}
+	return NULL;
+}
+
+#define LASSERT_HASHMAP(args, i, func_name) \
+	LASSERT(args, args->cell[i]->type == LVAL_HASHMAP, \
+		"Function %s passed incorrect type.  Got %s.  " \
+		"Expected %s.", func_name, ltype(args->cell[i]->type), \
+		ltype(LVAL_HASHMAP));
+
+#define LASSERT_KEY(args, i, hash, func_name) \
+	LASSERT(args, lhash_key(args->cell[i], &hash), \
+		"Function %s passed a key that can't be hashed:  %s.", \
+		func_name, ltype(args->cell[i]->type));
+
+struct lval *builtin_hashmap(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count % 2 == 0,
+		"Function hashmap passed an odd number of arguments.  "
+		"Expected keys and values.");
+	uint64_t hash;
+	for (int i = 0; i < args->count; i += 2)
+		LASSERT_KEY(args, i, hash, "hashmap");
+
+	struct lhash *h = lhash_new();
+	while (args->count) {
+		struct lval *k = lval_pop(args, 0);
+		struct lval *v = lval_pop(args, 0);
+		lhash_key(k, &hash);
+		lhash_put(h, k, hash, v);
+	}
+	lval_del(args);
+	return lval_hashmap(h);
+}
+
+struct lval *builtin_get(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count == 2 || args->count == 3,
+		"Function get passed incorrect number of arguments.  "
+		"Got %d.  Expected 2 or 3.", args->count);
+	LASSERT_HASHMAP(args, 0, "get");
+	uint64_t hash;
+	LASSERT_KEY(args, 1, hash, "get");
+
+	struct lval *result = lhash_get(args->cell[0]->val.hash,
+		args->cell[1], hash);
+	if (result == NULL && args->count == 3)
+		result = lval_pop(args, 2);
+	else if (result == NULL)
+		result = lval_sexpr();
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_put(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 3, "put");
+	LASSERT_HASHMAP(args, 0, "put");
+	uint64_t hash;
+	LASSERT_KEY(args, 1, hash, "put");
+
+	struct lval *v = lval_pop(args, 2);
+	struct lval *k = lval_pop(args, 1);
+	struct lval *m = lval_take(args, 0);
+	lhash_put(m->val.hash, k, hash, v);
+	return m;
+}
+
+struct lval *builtin_remove(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "remove");
+	LASSERT_HASHMAP(args, 0, "remove");
+	uint64_t hash;
+	LASSERT_KEY(args, 1, hash, "remove");
+
+	lhash_remove(args->cell[0]->val.hash, args->cell[1], hash);
+	return lval_take(args, 0);
+}
+
+struct lval *builtin_has(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "has");
+	LASSERT_HASHMAP(args, 0, "has");
+	uint64_t hash;
+	LASSERT_KEY(args, 1, hash, "has");
+
+	bool found = lhash_has(args->cell[0]->val.hash, args->cell[1],
+		hash);
+	lval_del(args);
+	return lval_bool(found);
+}
+
+struct lval *builtin_entries(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "entries");
+	LASSERT_HASHMAP(args, 0, "entries");
+
+	struct lhash *h = args->cell[0]->val.hash;
+	struct lval *result = lval_sexpr();
+	lhash_lock(h);
+	lquota_alloc(sizeof(struct lval *) * lhash_count(h));
+	result->cell = malloc(sizeof(struct lval *) * lhash_count(h));
+	size_t i = 0;
+	struct lhash_entry *e;
+	while ((e = lhash_next(h, &i)) != NULL) {
+		struct lval *pair = lval_sexpr();
+		pair = lval_append(pair, lval_copy(e->key));
+		pair = lval_append(pair, lval_copy(e->val));
+		result->cell[result->count++] = pair;
+	}
+	lhash_unlock(h);
+	lval_del(args);
+	return result;
+}
@@ -0,0 +1,204 @@
+/* pthreads are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/* Evaluation recurses deeply, so isolates get as much stack as main does */
+#define LISOLATE_STACK (8 * 1024 * 1024)
+
+struct lisolate {
+	int refs;
+	char *path;
+	pthread_mutex_t lock;
+	bool done;
+	/* What's waiting for it to be done */
+	struct levent_waiter *waiting;
+	/* The encoded argv, then the encoded result once it's done */
+	char *data;
+	size_t len;
+	/* The quota of the thread that started it, until it's running */
+	struct lquota *quota;
+};
+
+void lisolate_retain(struct lisolate *iso)
+{
+	LREF_RETAIN(iso->refs);
+}
+
+void lisolate_release(struct lisolate *iso)
+{
+	if (LREF_RELEASE(iso->refs) > 0)
+		return;
+	pthread_mutex_destroy(&iso->lock);
+	free(iso->path);
+	free(iso->data);
+	lquota_release(iso->quota);
+	free(iso);
+}
+
+const char *lisolate_path(struct lisolate *iso)
+{
+	return iso->path;
+}
+
+/*
+ * Encode a value to send to another isolate.  Returns NULL if it can't be,
+ * such as a port.
+ */
+static char *lisolate_encode(struct lenv *env, struct lval *v, size_t *len)
+{
+	struct lbuf b;
+	lbuf_string(&b);
+	lserial_header(&b);
+	bool ok = lserial_write(&b, env, v);
+	*len = b.len;
+	char *data = lbuf_take(&b);
+	if (!ok) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static void *lisolate_main(void *arg)
+{
+	struct lisolate *iso = arg;
+	lquota_swap(iso->quota);
+	iso->quota = NULL;
+
+	/* Nothing in here is reachable from any other isolate */
+	struct lenv *env = lenv_new();
+	lenv_add_builtins(env);
+
+	struct lval *result = lserial_decode(env, iso->data, iso->len);
+	free(iso->data);
+	if (result->type != LVAL_ERR) {
+		struct lval *k = lval_sym("argv");
+		lenv_let(env, k, result);
+		lval_del(k);
+		lval_del(result);
+
+		result = lload_forms(env, iso->path);
+		if (result->type != LVAL_ERR)
+			result = lload_eval(env, result, NULL);
+	}
+	/* Tasks share the isolate's globals, so they finish before it does */
+	ltask_drain();
+
+	size_t len;
+	char *data = lisolate_encode(env, result, &len);
+	if (data == NULL) {
+		struct lval *err = lval_err("Isolate %s returned a %s, which "
+			"can't be copied out of it.", iso->path,
+			ltype(result->type));
+		data = lisolate_encode(env, err, &len);
+		lval_del(err);
+	}
+	lval_del(result);
+	lenv_del(env);
+	lquota_release(lquota_swap(NULL));
+	lfree_drain();
+	levent_cleanup();
+
+	pthread_mutex_lock(&iso->lock);
+	iso->data = data;
+	iso->len = len;
+	iso->done = true;
+	levent_signal_all(iso->waiting);
+	iso->waiting = NULL;
+	pthread_mutex_unlock(&iso->lock);
+	lisolate_release(iso);
+	return NULL;
+}
+
+struct lval *builtin_isolate(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count > 0,
+		"Function isolate passed incorrect number of arguments.  "
+		"Got 0.  Expected at least 1.");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function isolate passed incorrect type for the path.  "
+		"Got %s.", ltype(args->cell[0]->type));
+
+	/* The rest of the arguments are copied in as the isolate's argv */
+	struct lval *script = lval_pop(args, 0);
+	size_t len;
+	char *data = lisolate_encode(env, args, &len);
+	if (data == NULL) {
+		lval_del(script);
+		LASSERT(args, false, "Function isolate passed arguments that "
+			"can't be copied into an isolate.");
+	}
+
+	/* One reference for the lval, and one for the thread */
+	struct lisolate *iso = malloc(sizeof(struct lisolate));
+	iso->refs = 2;
+	iso->path = malloc(strlen(path) + 1);
+	strcpy(iso->path, path);
+	pthread_mutex_init(&iso->lock, NULL);
+	iso->waiting = NULL;
+	iso->done = false;
+	iso->data = data;
+	iso->len = len;
+	iso->quota = lquota_get();
+	lquota_retain(iso->quota);
+	lval_del(script);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, LISOLATE_STACK);
+	pthread_t thread;
+	int status = pthread_create(&thread, &attr, lisolate_main, iso);
+	pthread_attr_destroy(&attr);
+	if (status != 0) {
+		iso->refs = 1;
+		lisolate_release(iso);
+		LASSERT(args, false, "Could not start an isolate:  %s",
+			strerror(status));
+	}
+
+	lval_del(args);
+	return lval_isolate(iso);
+}
+
+struct lval *builtin_isolate_join(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "isolate-join");
+	LASSERT(args, args->cell[0]->type == LVAL_ISOLATE,
+		"Function isolate-join passed incorrect type.  Got %s.  "
+		"Expected %s.", ltype(args->cell[0]->type),
+		ltype(LVAL_ISOLATE));
+
+	struct lisolate *iso = args->cell[0]->val.iso;
+	pthread_mutex_lock(&iso->lock);
+	struct levent_waiter *w = NULL;
+	if (!iso->done) {
+		w = levent_waiter_new();
+		levent_enlist(&iso->waiting, w);
+	}
+	pthread_mutex_unlock(&iso->lock);
+	if (w != NULL) {
+		bool ok = levent_await(w, &iso->lock, &iso->waiting, NULL);
+		levent_waiter_free(w);
+		if (!ok) {
+			lval_del(args);
+			return lquota_err();
+		}
+	}
+
+	/* Every join gets its own copy of the result */
+	struct lval *result = lserial_decode(env, iso->data, iso->len);
+	lval_del(args);
+	return result;
+}
@@ -0,0 +1,277 @@
+/* mkdir and getpid are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "mpc.h"
+#include "reader.h"
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Source file cache
+ *
+ * Reading a file means parsing it with mpc and converting the AST with
+ * lval_read, which is by far the slowest part of loading a library.  The
+ * forms read from each file are saved in the binary lval format, named by a
+ * hash of the file's contents, LSERIAL_VERSION and READER_VERSION, so
+ * loading an unchanged file again only has to decode them.  An edited file
+ * hashes differently and is read again, and stale entries are simply never
+ * looked up.
+ *
+ * The hash only picks the file name.  Each entry also holds the reader
+ * version and the whole source it was read from, which must both match
+ * before its forms are used, so a collision is just a miss.
+ *
+ * The cache lives in $MYLISP_CACHE if it's set, or in mylisp under
+ * $XDG_CACHE_HOME or ~/.cache.  Setting MYLISP_CACHE to the empty string
+ * turns the cache off.
+ */
+static long cache_hits;
+static long cache_misses;
+/* Numbers temporary cache files, since isolates share a pid */
+static long cache_writes;
+
+/* 64 bit FNV-1a */
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t lload_hash(const char *data, size_t len)
+{
+	uint64_t h = FNV_OFFSET;
+	uint32_t versions[] = { LSERIAL_VERSION, READER_VERSION };
+
+	for (int v = 0; v < 2; v++) {
+		for (int i = 0; i < 4; i++) {
+			h ^= (versions[v] >> (8 * i)) & 0xff;
+			h *= FNV_PRIME;
+		}
+	}
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char)data[i];
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+/* mkdir that doesn't mind the directory already existing */
+static bool lload_mkdir(const char *path)
+{
+	return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/*
+ * Find, and create if needed, the cache directory.  Returns false if there's
+ * no usable cache directory, in which case every load is a miss.
+ */
+static bool lload_cache_dir(char *dir, size_t size)
+{
+	char *env = getenv("MYLISP_CACHE");
+	if (env != NULL) {
+		if (*env == '\0')
+			return false;
+		snprintf(dir, size, "%s", env);
+		return lload_mkdir(dir);
+	}
+
+	char *home;
+	if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env != '\0') {
+		snprintf(dir, size, "%s", env);
+	} else if ((home = getenv("HOME")) != NULL) {
+		snprintf(dir, size, "%s/.cache", home);
+	} else {
+		return false;
+	}
+	if (!lload_mkdir(dir))
+		return false;
+	size_t n = strlen(dir);
+	snprintf(dir + n, size - n, "/mylisp");
+	return lload_mkdir(dir);
+}
+
+/*
+ * Look for the forms of a file in the cache, given its source.  Returns
+ * NULL on a miss
+ */
+static struct lval *lload_cache_get(struct lenv *env, char *path,
+	const char *source, size_t source_len)
+{
+	size_t len;
+	const char *data = lserial_map(path, &len);
+	if (data == NULL)
+		return NULL;
+	struct lval *entry = lserial_decode(env, data, len);
+	lserial_unmap(data, len);
+
+	/*
+	 * An entry is (READER_VERSION source forms).  A corrupt or truncated
+	 * one, or one for other source that hashed the same, is a miss, and
+	 * is rewritten.
+	 */
+	bool ok = entry->type == LVAL_SEXPR && entry->count == 3 &&
+		entry->cell[0]->type == LVAL_LONG &&
+		entry->cell[0]->val.num_long == READER_VERSION &&
+		entry->cell[1]->type == LVAL_BYTES &&
+		entry->cell[1]->val.str.len == source_len &&
+		memcmp(lval_cstr(entry->cell[1]), source, source_len) == 0 &&
+		entry->cell[2]->type == LVAL_SEXPR;
+	if (!ok) {
+		lval_del(entry);
+		return NULL;
+	}
+	return lval_take(entry, 2);
+}
+
+/*
+ * Save the forms of a file to the cache.  They're written to a temporary
+ * file and renamed into place, so another process loading the same file
+ * never sees a partial entry.  Failing to write the cache isn't an error.
+ */
+static void lload_cache_put(struct lenv *env, char *path,
+	const char *source, size_t source_len, struct lval *forms)
+{
+	struct lval *entry = lval_sexpr();
+	entry = lval_append(entry, lval_long(READER_VERSION));
+	entry = lval_append(entry, lval_bytes(source, source_len));
+	entry = lval_append(entry, forms);
+
+	struct lbuf b;
+	lbuf_string(&b);
+	lserial_header(&b);
+	bool ok = lserial_write(&b, env, entry);
+	/* The forms are still the caller's */
+	lval_pop(entry, 2);
+	lval_del(entry);
+	size_t len = b.len;
+	char *data = lbuf_take(&b);
+	if (!ok) {
+		free(data);
+		return;
+	}
+
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.%ld.%ld.tmp", path, (long)getpid(),
+		__atomic_add_fetch(&cache_writes, 1, __ATOMIC_RELAXED));
+	FILE *f = fopen(tmp, "wb");
+	if (f != NULL) {
+		ok = fwrite(data, 1, len, f) == len;
+		ok = (fclose(f) == 0) && ok;
+		if (!ok || rename(tmp, path) != 0)
+			remove(tmp);
+	}
+	free(data);
+}
+
+/* Parse source text into an S-expression of its forms */
+static struct lval *lload_read(char *path, const char *data, size_t len)
+{
+	/* The parser wants a NUL terminated string, and data is mapped */
+	char *input = malloc(len + 1);
+	memcpy(input, data, len);
+	input[len] = '\0';
+
+	mpc_arena_t *arena = mpc_arena_new();
+	char *error = NULL;
+	mpc_ast_t *ast = reader_parse_program(arena, path, input, &error);
+	struct lval *forms;
+	if (ast != NULL) {
+		forms = lval_read_program(ast);
+	} else {
+		/* mpc ends its error messages with a newline */
+		size_t n = strlen(error);
+		if (n > 0 && error[n - 1] == '\n')
+			error[n - 1] = '\0';
+		forms = lval_err("%s", error);
+		free(error);
+	}
+	mpc_arena_delete(arena);
+	free(input);
+	return forms;
+}
+
+struct lval *lload_forms(struct lenv *env, char *path)
+{
+	size_t len;
+	const char *data = lserial_map(path, &len);
+	if (data == NULL)
+		return lval_err("Could not read %s:  %s", path, strerror(errno));
+
+	char cache[4096];
+	bool cached = lload_cache_dir(cache, sizeof(cache));
+	if (cached) {
+		size_t n = strlen(cache);
+		snprintf(cache + n, sizeof(cache) - n, "/%016llx.mylb",
+			(unsigned long long)lload_hash(data, len));
+		struct lval *forms = lload_cache_get(env, cache, data, len);
+		if (forms != NULL) {
+			__atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+			lserial_unmap(data, len);
+			return forms;
+		}
+	}
+
+	__atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+	struct lval *forms = lload_read(path, data, len);
+	if (cached && forms->type == LVAL_SEXPR)
+		lload_cache_put(env, cache, data, len, forms);
+	lserial_unmap(data, len);
+	return forms;
+}
+
+struct lval *lload_eval(struct lenv *env, struct lval *forms, FILE *out)
+{
+	/* Evaluate each form in order, stopping at the first error */
+	struct lval *result = lval_sexpr();
+	for (int i = 0; i < forms->count; i++) {
+		lval_del(result);
+		result = lval_eval(env, forms->cell[i]);
+		forms->cell[i] = NULL;
+		if (result->type == LVAL_ERR)
+			break;
+		if (out != NULL)
+			lval_println(out, result);
+	}
+
+	/* lval_eval consumed the forms it was given */
+	for (int i = 0; i < forms->count; i++) {
+		if (forms->cell[i])
+			lval_del(forms->cell[i]);
+	}
+	forms->count = 0;
+	lval_del(forms);
+	return result;
+}
+
+struct lval *builtin_load(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "load");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function load passed incorrect type for the path.  Got %s.",
+		ltype(args->cell[0]->type));
+
+	struct lval *forms = lload_forms(env, path);
+	lval_del(args);
+	if (forms->type == LVAL_ERR)
+		return forms;
+	return lload_eval(env, forms, NULL);
+}
+
+struct lval *builtin_cache_stats(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 0, "cache-stats");
+	lval_del(args);
+	struct lval *stats = lval_sexpr();
+	stats = lval_append(stats, lval_long(cache_hits));
+	stats = lval_append(stats, lval_long(cache_misses));
+	return stats;
+}
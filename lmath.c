@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "dbg.h"
 
@@ -128,6 +129,11 @@ struct lval *lval_eq(struct lval *x, struct lval *y)
 		return lval_bool(x->val.num_double == y->val.num_long);
 	if (x->type == LVAL_DOUBLE && y->type == LVAL_DOUBLE)
 		return lval_bool(x->val.num_double == y->val.num_double);
+	/* Strings and bytes are equal if they hold the same bytes */
+	if (x->type == y->type &&
+		(x->type == LVAL_STRING || x->type == LVAL_BYTES))
+		return lval_bool(x->val.str.len == y->val.str.len &&
+			memcmp(LVAL_STR(x), LVAL_STR(y), x->val.str.len) == 0);
 	return lval_err("Invalid number types: %s and %s.", ltype(x->type),
 		ltype(y->type));
 }
@@ -260,7 +266,10 @@ struct lval *builtin_comp(struct lenv *env, char *op, struct lval *numbers)
 	debug("Called builtin_comp");
 	LASSERT_ARGC(numbers, 2, op);
 	debug("Numbers contains 2 arguments");
-	struct lval *type_err = _ensure_numbers(op, numbers);
+	/* = also compares strings and bytes, and lval_eq checks their types */
+	struct lval *type_err = NULL;
+	if (strcmp(op, "=") != 0)
+		type_err = _ensure_numbers(op, numbers);
 	if (type_err)
 		return type_err;
 
@@ -0,0 +1,371 @@
+/* pthreads and sysconf are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * The thread pool behind pmap and futures.
+ *
+ * For pmap, each thread owns a range of the list's indices and works
+ * through it from the front.  A thread whose range runs out steals the back
+ * half of another thread's, so a few slow elements don't leave the rest of
+ * the pool idle.  The thread that called pmap works too, as thread 0, so
+ * the pool only starts size - 1 threads of its own.  It steals the ranges
+ * of threads that are busy running futures, so it never waits for them.
+ *
+ * Futures wait in a bounded queue, which threads take from whenever there's
+ * no pmap to help with.
+ *
+ * Copying a very long list is split up the same way, a chunk of elements at
+ * a time, so it takes a fraction as long.  That's done anywhere a list is
+ * copied, such as every time a symbol is looked up, so unlike pmap it only
+ * uses the pool while no thread is running a future, which might be waiting
+ * for the thread that's doing the copying.  Long lists aren't freed here,
+ * since lfree frees them a slice at a time without holding anything up.
+ */
+
+/* Evaluation recurses deeply, so workers get as much stack as main does */
+#define LPOOL_STACK (8 * 1024 * 1024)
+/* Futures that can wait for a thread at once */
+#define LPOOL_QUEUE 256
+/* Elements each thread copies at a time */
+#define LPOOL_CHUNK 4096
+
+struct lpool_range {
+	pthread_mutex_t lock;
+	size_t lo;
+	size_t hi;
+};
+
+struct lpool_job {
+	/* Do the ith task in the job */
+	void (*task)(struct lpool_job *job, size_t i);
+	struct lenv *env;
+	struct lval *f;
+	/* The list's elements, which each task takes, and the results */
+	struct lval **items;
+	struct lval **results;
+	/* Elements in the list, when each task does a chunk of them */
+	size_t count;
+	/* Only use the pool if it has nothing else to do */
+	bool idle;
+	struct lpool_range *ranges;
+	int size;
+	/* The quota of the thread that started it, which every thread uses */
+	struct lquota *quota;
+};
+
+static pthread_mutex_t lpool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Workers wait on this for a new job, and pmap waits on it for workers */
+static pthread_cond_t lpool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lpool_idle = PTHREAD_COND_INITIALIZER;
+/* The job workers can still join, or NULL once its caller is done */
+static struct lpool_job *lpool_job;
+/* Bumped for every job, so a worker can tell a new job from the last one */
+static unsigned long lpool_generation;
+/* Workers that joined the current job and haven't finished it yet */
+static int lpool_busy;
+/* Threads in the pool, counting pmap's caller, or 0 before it starts */
+static int lpool_size;
+/* Set while a job is running, so a nested pmap runs sequentially instead */
+static bool lpool_running;
+/* Futures that pool threads are running */
+static int lpool_futures;
+/* Set on the pool's own threads, whose pmaps run sequentially too */
+static pthread_key_t lpool_worker_key;
+/* A ring buffer of queued futures */
+static struct lfuture *lpool_queue[LPOOL_QUEUE];
+static size_t lpool_head;
+static size_t lpool_queued;
+
+static void lpool_call(struct lpool_job *job, size_t i)
+{
+	/* set in the lambda binds here, not in the shared environment */
+	struct lenv *env = lenv_new();
+	env->parent = job->env;
+	env->isolated = true;
+
+	struct lval *args = lval_append(lval_sexpr(), job->items[i]);
+	job->items[i] = NULL;
+	struct lval *f = lval_copy(job->f);
+	/* Even on the thread that called pmap, exit only ends the call */
+	bool allowed = lval_allow_exit(false);
+	job->results[i] = lval_call(env, f, args);
+	lval_allow_exit(allowed);
+	lval_del(f);
+	lenv_del(env);
+}
+
+static void lpool_copy_chunk(struct lpool_job *job, size_t i)
+{
+	size_t end = (i + 1) * LPOOL_CHUNK;
+	if (end > job->count)
+		end = job->count;
+	for (size_t j = i * LPOOL_CHUNK; j < end; j++)
+		job->results[j] = lval_copy(job->items[j]);
+}
+
+/* Take the next index from a thread's own range */
+static bool lpool_next(struct lpool_range *r, size_t *i)
+{
+	pthread_mutex_lock(&r->lock);
+	bool found = r->lo < r->hi;
+	if (found)
+		*i = r->lo++;
+	pthread_mutex_unlock(&r->lock);
+	return found;
+}
+
+/* Move the back half of another thread's range to an empty one */
+static bool lpool_steal(struct lpool_job *job, int id)
+{
+	for (int k = 1; k < job->size; k++) {
+		struct lpool_range *victim = &job->ranges[(id + k) % job->size];
+		pthread_mutex_lock(&victim->lock);
+		size_t lo = victim->lo + (victim->hi - victim->lo) / 2;
+		size_t hi = victim->hi;
+		victim->hi = lo;
+		pthread_mutex_unlock(&victim->lock);
+
+		if (lo < hi) {
+			struct lpool_range *r = &job->ranges[id];
+			pthread_mutex_lock(&r->lock);
+			r->lo = lo;
+			r->hi = hi;
+			pthread_mutex_unlock(&r->lock);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void lpool_run(struct lpool_job *job, int id)
+{
+	lquota_retain(job->quota);
+	struct lquota *quota = lquota_swap(job->quota);
+	size_t i;
+	do {
+		while (lpool_next(&job->ranges[id], &i))
+			job->task(job, i);
+	} while (lpool_steal(job, id));
+	lquota_release(lquota_swap(quota));
+}
+
+static void *lpool_worker(void *arg)
+{
+	int id = (intptr_t)arg;
+	unsigned long seen = 0;
+	pthread_setspecific(lpool_worker_key, arg);
+
+	pthread_mutex_lock(&lpool_lock);
+	for (;;) {
+		while (lpool_generation == seen && lpool_queued == 0)
+			pthread_cond_wait(&lpool_work, &lpool_lock);
+
+		if (lpool_generation == seen) {
+			struct lfuture *f = lpool_queue[lpool_head];
+			lpool_head = (lpool_head + 1) % LPOOL_QUEUE;
+			lpool_queued--;
+			lpool_futures++;
+			pthread_mutex_unlock(&lpool_lock);
+			lfuture_run(f);
+			lfuture_release(f);
+			ltask_drain();
+			pthread_mutex_lock(&lpool_lock);
+			lpool_futures--;
+			continue;
+		}
+
+		/*
+		 * A worker that was running a future may only get here once
+		 * the caller has done the whole job itself, and then it's gone
+		 */
+		seen = lpool_generation;
+		struct lpool_job *job = lpool_job;
+		if (job == NULL)
+			continue;
+		lpool_busy++;
+		pthread_mutex_unlock(&lpool_lock);
+
+		if (id < job->size)
+			lpool_run(job, id);
+		/*
+		 * Nothing else would ever run tasks that were spawned here, or
+		 * free lists dropped here, and ltask_drain does both
+		 */
+		ltask_drain();
+
+		pthread_mutex_lock(&lpool_lock);
+		if (--lpool_busy == 0)
+			pthread_cond_signal(&lpool_idle);
+	}
+	return NULL;
+}
+
+/*
+ * Start the pool, with a thread per CPU unless MYLISP_THREADS says
+ * otherwise.  Called with lpool_lock held.
+ */
+static void lpool_start(void)
+{
+	long size = sysconf(_SC_NPROCESSORS_ONLN);
+	char *env = getenv("MYLISP_THREADS");
+	if (env != NULL && *env != '\0')
+		size = strtol(env, NULL, 10);
+	if (size < 1)
+		size = 1;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, LPOOL_STACK);
+	pthread_key_create(&lpool_worker_key, NULL);
+
+	lpool_size = 1;
+	for (; lpool_size < size; lpool_size++) {
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, lpool_worker,
+			(void *)(intptr_t)lpool_size) != 0) {
+			log_warn("Could only start %d threads for pmap",
+				lpool_size);
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+bool lpool_submit(struct lfuture *f)
+{
+	pthread_mutex_lock(&lpool_lock);
+	if (lpool_size == 0)
+		lpool_start();
+	bool queued = lpool_size > 1 && lpool_queued < LPOOL_QUEUE;
+	if (queued) {
+		lfuture_retain(f);
+		lpool_queue[(lpool_head + lpool_queued) % LPOOL_QUEUE] = f;
+		lpool_queued++;
+		pthread_cond_signal(&lpool_work);
+	}
+	pthread_mutex_unlock(&lpool_lock);
+	return queued;
+}
+
+/* Run every task in the job, on the pool if it's free */
+static void lpool_map(struct lpool_job *job, size_t n)
+{
+	pthread_mutex_lock(&lpool_lock);
+	if (lpool_size == 0)
+		lpool_start();
+	bool parallel = !lpool_running && n > 1 &&
+		pthread_getspecific(lpool_worker_key) == NULL &&
+		(!job->idle || (lpool_futures == 0 && lpool_queued == 0));
+	if (parallel)
+		lpool_running = true;
+	pthread_mutex_unlock(&lpool_lock);
+
+	if (!parallel || lpool_size == 1) {
+		for (size_t i = 0; i < n; i++)
+			job->task(job, i);
+		pthread_mutex_lock(&lpool_lock);
+		if (parallel)
+			lpool_running = false;
+		pthread_mutex_unlock(&lpool_lock);
+		return;
+	}
+
+	/* Deal the list out in even, contiguous ranges */
+	job->size = (size_t)lpool_size < n ? lpool_size : (int)n;
+	job->ranges = malloc(sizeof(struct lpool_range) * job->size);
+	for (int id = 0; id < job->size; id++) {
+		pthread_mutex_init(&job->ranges[id].lock, NULL);
+		job->ranges[id].lo = n * id / job->size;
+		job->ranges[id].hi = n * (id + 1) / job->size;
+	}
+
+	/* The job is on this stack, so a task running pmap can't yield */
+	ltask_pin();
+	pthread_mutex_lock(&lpool_lock);
+	lpool_job = job;
+	lpool_generation++;
+	pthread_cond_broadcast(&lpool_work);
+	pthread_mutex_unlock(&lpool_lock);
+
+	/*
+	 * This steals from the ranges of workers that are busy with futures,
+	 * so it only waits for the workers that joined in
+	 */
+	lpool_run(job, 0);
+
+	pthread_mutex_lock(&lpool_lock);
+	lpool_job = NULL;
+	while (lpool_busy > 0)
+		pthread_cond_wait(&lpool_idle, &lpool_lock);
+	lpool_running = false;
+	pthread_mutex_unlock(&lpool_lock);
+	ltask_unpin();
+
+	for (int id = 0; id < job->size; id++)
+		pthread_mutex_destroy(&job->ranges[id].lock);
+	free(job->ranges);
+}
+
+struct lval *builtin_pmap(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "pmap");
+	LASSERT_TYPE(args->cell[0], LVAL_FUNC, "pmap");
+	LASSERT_TYPE(args->cell[1], LVAL_SEXPR, "pmap");
+
+	struct lval *xs = args->cell[1];
+	size_t n = xs->count;
+	struct lpool_job job = {
+		.task = lpool_call,
+		.env = env,
+		.f = args->cell[0],
+		.items = xs->cell,
+		.results = malloc(sizeof(struct lval *) * n),
+		.quota = lquota_get(),
+	};
+	lpool_map(&job, n);
+	/* The tasks took every element */
+	xs->count = 0;
+	lval_del(args);
+
+	/* The results in order, or the first error in order */
+	struct lval *result = lval_sexpr();
+	for (size_t i = 0; i < n; i++) {
+		struct lval *x = job.results[i];
+		if (result->type != LVAL_ERR && x->type == LVAL_ERR) {
+			lval_del(result);
+			result = x;
+		} else if (result->type != LVAL_ERR) {
+			lval_append(result, x);
+		} else {
+			lval_del(x);
+		}
+	}
+	free(job.results);
+	return result;
+}
+
+void lpool_copy(struct lval **dst, struct lval **src, size_t n)
+{
+	struct lpool_job job = {
+		.task = lpool_copy_chunk,
+		.items = src,
+		.results = dst,
+		.count = n,
+		.idle = true,
+		.quota = lquota_get(),
+	};
+	lpool_map(&job, (n + LPOOL_CHUNK - 1) / LPOOL_CHUNK);
+}
@@ -0,0 +1,518 @@
+/* open, read, write and sockets are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Ports talk to their files with read and write directly rather than through
+ * stdio, so that a whole buffer moves in one system call and a line can be
+ * handed back in place, without copying it out of the buffer first.
+ */
+
+/*
+ * Writable ports, which are flushed at exit so buffered output isn't lost.
+ * Every isolate opens and closes ports on the same list, under the lock.
+ */
+static struct lport *lport_writers;
+static pthread_mutex_t lport_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lport_flush_all(void)
+{
+	pthread_mutex_lock(&lport_lock);
+	for (struct lport *p = lport_writers; p != NULL; p = p->next) {
+		/* There's no event loop to wait on any more */
+		if (p->stream && p->fd >= 0) {
+			int flags = fcntl(p->fd, F_GETFL);
+			fcntl(p->fd, F_SETFL, flags & ~O_NONBLOCK);
+		}
+		lport_flush(p);
+	}
+	pthread_mutex_unlock(&lport_lock);
+}
+
+/* Make a port on an open file descriptor, which it takes */
+static struct lport *lport_new(int fd, const char *path, bool writable,
+	bool stream)
+{
+	static bool registered;
+
+	if (stream)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	struct lport *p = malloc(sizeof(struct lport));
+	p->fd = fd;
+	p->refs = 1;
+	p->readable = !writable;
+	p->writable = writable;
+	p->eof = false;
+	p->stream = stream;
+	p->path = malloc(strlen(path) + 1);
+	strcpy(p->path, path);
+	p->cap = stream ? LPORT_STREAM_SIZE : LPORT_SIZE;
+	p->buf = malloc(p->cap);
+	p->start = 0;
+	p->end = 0;
+	p->prev = NULL;
+	p->next = NULL;
+
+	if (p->writable) {
+		pthread_mutex_lock(&lport_lock);
+		if (!registered) {
+			atexit(lport_flush_all);
+			registered = true;
+		}
+		p->next = lport_writers;
+		if (lport_writers != NULL)
+			lport_writers->prev = p;
+		lport_writers = p;
+		pthread_mutex_unlock(&lport_lock);
+	}
+	return p;
+}
+
+struct lport *lport_open(const char *path, const char *mode)
+{
+	int flags;
+
+	if (strcmp(mode, "r") == 0) {
+		flags = O_RDONLY;
+	} else if (strcmp(mode, "w") == 0) {
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	} else if (strcmp(mode, "a") == 0) {
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	} else {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	int fd = open(path, flags, 0644);
+	if (fd < 0)
+		return NULL;
+	return lport_new(fd, path, flags != O_RDONLY, false);
+}
+
+void lport_retain(struct lport *p)
+{
+	LREF_RETAIN(p->refs);
+}
+
+void lport_release(struct lport *p)
+{
+	if (LREF_RELEASE(p->refs) > 0)
+		return;
+	lport_close(p);
+	free(p->path);
+	free(p->buf);
+	free(p);
+}
+
+static bool lport_write_all(int fd, const char *s, size_t n)
+{
+	while (n > 0) {
+		ssize_t w = write(fd, s, n);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			/* A full pipe or socket, until the other end reads */
+			if (errno == EAGAIN && levent_wait(fd, true))
+				continue;
+			return false;
+		}
+		s += w;
+		n -= w;
+	}
+	return true;
+}
+
+bool lport_flush(struct lport *p)
+{
+	if (!p->writable || p->fd < 0)
+		return true;
+	bool ok = lport_write_all(p->fd, p->buf, p->end);
+	p->end = 0;
+	return ok;
+}
+
+bool lport_close(struct lport *p)
+{
+	if (p->fd < 0)
+		return true;
+
+	bool ok = lport_flush(p);
+	/* The other end of a socket sees EOF, even if it has another port */
+	if (p->stream && p->writable)
+		shutdown(p->fd, SHUT_WR);
+	levent_forget(p->fd);
+	if (p->writable) {
+		pthread_mutex_lock(&lport_lock);
+		if (p->prev != NULL)
+			p->prev->next = p->next;
+		else
+			lport_writers = p->next;
+		if (p->next != NULL)
+			p->next->prev = p->prev;
+		pthread_mutex_unlock(&lport_lock);
+	}
+	ok = (close(p->fd) == 0) && ok;
+	p->fd = -1;
+	p->eof = true;
+	p->start = 0;
+	p->end = 0;
+	return ok;
+}
+
+/*
+ * Move the unread input to the front of the buffer, growing it if it's
+ * full, and read more after it.  Returns false at EOF.
+ */
+static bool lport_fill(struct lport *p)
+{
+	if (p->eof)
+		return false;
+
+	if (p->start > 0) {
+		memmove(p->buf, p->buf + p->start, p->end - p->start);
+		p->end -= p->start;
+		p->start = 0;
+	}
+	if (p->end == p->cap) {
+		p->cap *= 2;
+		p->buf = realloc(p->buf, p->cap);
+	}
+
+	ssize_t n;
+	for (;;) {
+		n = read(p->fd, p->buf + p->end, p->cap - p->end);
+		if (n >= 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		/* An empty pipe or socket, until the other end writes */
+		if (errno == EAGAIN && levent_wait(p->fd, false) && p->fd >= 0)
+			continue;
+		break;
+	}
+	/* Running out of time isn't the end of the stream */
+	if (n < 0 && errno == ETIMEDOUT)
+		return false;
+	if (n <= 0) {
+		p->eof = true;
+		return false;
+	}
+	p->end += n;
+	return true;
+}
+
+const char *lport_read_line(struct lport *p, size_t *len)
+{
+	if (!p->readable || p->fd < 0)
+		return NULL;
+
+	/* Bytes after start that are already known not to be newlines */
+	size_t scanned = 0;
+	do {
+		char *line = p->buf + p->start;
+		char *nl = memchr(line + scanned, '\n',
+			p->end - p->start - scanned);
+		if (nl != NULL) {
+			*len = nl - line;
+			p->start += *len + 1;
+			return line;
+		}
+		scanned = p->end - p->start;
+	} while (lport_fill(p));
+
+	/* The last line might not end with a newline */
+	if (p->start == p->end)
+		return NULL;
+	const char *line = p->buf + p->start;
+	*len = p->end - p->start;
+	p->start = p->end;
+	return line;
+}
+
+const char *lport_read(struct lport *p, size_t n, size_t *len)
+{
+	if (!p->readable || p->fd < 0)
+		return NULL;
+
+	while (p->end - p->start < n && lport_fill(p))
+		;
+	size_t avail = p->end - p->start;
+	if (avail == 0)
+		return NULL;
+	*len = avail < n ? avail : n;
+	const char *s = p->buf + p->start;
+	p->start += *len;
+	return s;
+}
+
+bool lport_write(struct lport *p, const char *s, size_t n)
+{
+	if (!p->writable || p->fd < 0) {
+		errno = EBADF;
+		return false;
+	}
+	if (p->end + n > p->cap) {
+		if (!lport_flush(p))
+			return false;
+		/* Anything that doesn't fit in an empty buffer goes straight out */
+		if (n > p->cap)
+			return lport_write_all(p->fd, s, n);
+	}
+	memcpy(p->buf + p->end, s, n);
+	p->end += n;
+	return true;
+}
+
+#define LASSERT_PORT(args, i, func_name) \
+	LASSERT(args, args->cell[i]->type == LVAL_PORT, \
+		"Function %s passed incorrect type.  Got %s.  " \
+		"Expected %s.", func_name, ltype(args->cell[i]->type), \
+		ltype(LVAL_PORT));
+
+struct lval *builtin_open(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "open");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function open passed incorrect type for the path.  Got %s.",
+		ltype(args->cell[0]->type));
+	LASSERT(args, args->cell[1]->type == LVAL_SYM,
+		"Function open passed incorrect type for the mode.  "
+		"Got %s.  Expected %s.", ltype(args->cell[1]->type),
+		ltype(LVAL_SYM));
+
+	struct lport *p = lport_open(path, args->cell[1]->val.sym);
+	LASSERT(args, p != NULL, "Could not open %s:  %s", path,
+		strerror(errno));
+	lval_del(args);
+	return lval_port(p);
+}
+
+struct lval *builtin_read_line(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "read-line");
+	LASSERT_PORT(args, 0, "read-line");
+
+	size_t len;
+	const char *line = lport_read_line(args->cell[0]->val.port, &len);
+	struct lval *result = line ? lval_string(line, len) : lval_sexpr();
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_read_bytes(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "read-bytes");
+	LASSERT_PORT(args, 0, "read-bytes");
+	LASSERT(args, args->cell[1]->type == LVAL_LONG &&
+		args->cell[1]->val.num_long >= 0,
+		"Function read-bytes needs a count of bytes to read.");
+
+	size_t len;
+	const char *s = lport_read(args->cell[0]->val.port,
+		args->cell[1]->val.num_long, &len);
+	struct lval *result = s ? lval_bytes(s, len) : lval_sexpr();
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_write(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "write");
+	LASSERT_PORT(args, 0, "write");
+
+	struct lport *p = args->cell[0]->val.port;
+	struct lval *v = args->cell[1];
+	bool ok;
+
+	/* Text is written as it is, everything else as it prints */
+	if (v->type == LVAL_STRING || v->type == LVAL_BYTES) {
+		ok = lport_write(p, LVAL_STR(v), v->val.str.len);
+	} else if (v->type == LVAL_SYM) {
+		ok = lport_write(p, v->val.sym, strlen(v->val.sym));
+	} else {
+		struct lbuf b;
+		lbuf_string(&b);
+		lbuf_lval(&b, v);
+		ok = lport_write(p, b.data, b.len);
+		if (b.data != b.fixed)
+			free(b.data);
+	}
+	LASSERT(args, ok, "Could not write to %s:  %s", p->path,
+		strerror(errno));
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_flush(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "flush");
+	LASSERT_PORT(args, 0, "flush");
+
+	struct lport *p = args->cell[0]->val.port;
+	LASSERT(args, lport_flush(p), "Could not write to %s:  %s", p->path,
+		strerror(errno));
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_close(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "close");
+	if (args->cell[0]->type == LVAL_CHANNEL) {
+		lchan_close(args->cell[0]->val.chan);
+		lval_del(args);
+		return lval_sexpr();
+	}
+	LASSERT_PORT(args, 0, "close");
+
+	struct lport *p = args->cell[0]->val.port;
+	LASSERT(args, lport_close(p), "Could not close %s:  %s", p->path,
+		strerror(errno));
+	lval_del(args);
+	return lval_sexpr();
+}
+
+/* Make the (in out) ports on a connected socket, which they take */
+static struct lval *lport_socket_pair(int fd, const char *path)
+{
+	int out = dup(fd);
+	if (out < 0) {
+		struct lval *err = lval_err("Could not open %s:  %s", path,
+			strerror(errno));
+		close(fd);
+		return err;
+	}
+	struct lval *ports = lval_sexpr();
+	ports = lval_append(ports, lval_port(lport_new(fd, path, false, true)));
+	ports = lval_append(ports, lval_port(lport_new(out, path, true, true)));
+	return ports;
+}
+
+/* Fill in the address of a Unix domain socket */
+static bool lport_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+struct lval *builtin_pipe(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 0, "pipe");
+	int fds[2];
+	LASSERT(args, pipe(fds) == 0, "Could not make a pipe:  %s",
+		strerror(errno));
+	lval_del(args);
+
+	struct lval *ports = lval_sexpr();
+	ports = lval_append(ports, lval_port(lport_new(fds[0], "pipe", false,
+		true)));
+	ports = lval_append(ports, lval_port(lport_new(fds[1], "pipe", true,
+		true)));
+	return ports;
+}
+
+struct lport *lport_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = -1;
+	bool ok = lport_address(&addr, path) &&
+		(fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+		bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+		listen(fd, SOMAXCONN) == 0;
+	if (!ok) {
+		int saved = errno;
+		if (fd >= 0)
+			close(fd);
+		errno = saved;
+		return NULL;
+	}
+	return lport_new(fd, path, false, true);
+}
+
+struct lval *lport_accept(struct lport *p)
+{
+	/* Wait for a connection, letting other tasks run meanwhile */
+	int fd;
+	do {
+		fd = accept(p->fd, NULL, NULL);
+	} while (fd < 0 && (errno == EINTR ||
+		(errno == EAGAIN && levent_wait(p->fd, false))));
+	if (fd < 0)
+		return lval_err("Could not accept on %s:  %s", p->path,
+			strerror(errno));
+	return lport_socket_pair(fd, p->path);
+}
+
+struct lval *builtin_listen(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "listen");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function listen passed incorrect type for the path.  Got %s.",
+		ltype(args->cell[0]->type));
+
+	struct lport *p = lport_listen(path);
+	LASSERT(args, p != NULL, "Could not listen on %s:  %s", path,
+		strerror(errno));
+	lval_del(args);
+	return lval_port(p);
+}
+
+struct lval *builtin_accept(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "accept");
+	LASSERT_PORT(args, 0, "accept");
+
+	struct lval *ports = lport_accept(args->cell[0]->val.port);
+	lval_del(args);
+	return ports;
+}
+
+struct lval *builtin_connect(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "connect");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function connect passed incorrect type for the path.  "
+		"Got %s.", ltype(args->cell[0]->type));
+
+	struct sockaddr_un addr;
+	int fd = -1;
+	bool ok = lport_address(&addr, path) &&
+		(fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 &&
+		connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	if (!ok && fd >= 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+	}
+	LASSERT(args, ok, "Could not connect to %s:  %s", path,
+		strerror(errno));
+
+	struct lval *ports = lport_socket_pair(fd, path);
+	lval_del(args);
+	return ports;
+}
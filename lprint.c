@@ -0,0 +1,476 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+void lbuf_file(struct lbuf *b, FILE *stream)
+{
+	b->stream = stream;
+	b->data = b->fixed;
+	b->len = 0;
+	b->cap = LBUF_SIZE;
+}
+
+void lbuf_string(struct lbuf *b)
+{
+	b->stream = NULL;
+	b->data = b->fixed;
+	b->len = 0;
+	b->cap = LBUF_SIZE;
+}
+
+void lbuf_flush(struct lbuf *b)
+{
+	if (b->stream == NULL)
+		return;
+	fwrite(b->data, 1, b->len, b->stream);
+	b->len = 0;
+}
+
+/* Make room for n more bytes, either by flushing or by growing */
+static void lbuf_reserve(struct lbuf *b, size_t n)
+{
+	if (b->len + n <= b->cap)
+		return;
+	if (b->stream != NULL) {
+		lbuf_flush(b);
+		if (n <= b->cap)
+			return;
+	}
+	size_t cap = b->cap;
+	while (b->len + n > cap)
+		cap *= 2;
+	if (b->data == b->fixed) {
+		b->data = malloc(cap);
+		memcpy(b->data, b->fixed, b->len);
+	} else {
+		b->data = realloc(b->data, cap);
+	}
+	b->cap = cap;
+}
+
+void lbuf_write(struct lbuf *b, const char *s, size_t n)
+{
+	lbuf_reserve(b, n);
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+}
+
+void lbuf_putc(struct lbuf *b, char c)
+{
+	if (b->len == b->cap)
+		lbuf_reserve(b, 1);
+	b->data[b->len++] = c;
+}
+
+void lbuf_puts(struct lbuf *b, const char *s)
+{
+	lbuf_write(b, s, strlen(s));
+}
+
+void lbuf_long(struct lbuf *b, long x)
+{
+	/* Enough for the 20 digits and sign of a 64 bit long */
+	char digits[24];
+	int i = sizeof(digits);
+	/* Negate as unsigned so that LONG_MIN doesn't overflow */
+	unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+
+	do {
+		digits[--i] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (x < 0)
+		digits[--i] = '-';
+	lbuf_write(b, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * Write the decimal digits d[0..n) with the decimal point placed before
+ * d[point].  The reader has no exponent syntax, so everything is printed in
+ * fixed notation, and whole numbers keep a ".0" so they read back as floats.
+ */
+static void lbuf_fixed(struct lbuf *b, const char *d, int n, int point)
+{
+	if (point <= 0) {
+		lbuf_write(b, "0.", 2);
+		for (int i = point; i < 0; i++)
+			lbuf_putc(b, '0');
+		lbuf_write(b, d, n);
+	} else if (point >= n) {
+		lbuf_write(b, d, n);
+		for (int i = n; i < point; i++)
+			lbuf_putc(b, '0');
+		lbuf_write(b, ".0", 2);
+	} else {
+		lbuf_write(b, d, point);
+		lbuf_putc(b, '.');
+		lbuf_write(b, d + point, n - point);
+	}
+}
+
+#ifdef __SIZEOF_INT128__
+/*
+ * Find the shortest decimal that reads back as x exactly, for
+ * 1e-6 <= x < 2^53.  Returns false for anything outside that range.
+ *
+ * x is M / 2^s for an integer mantissa M, so x * 10^k is M * 10^k / 2^s, and
+ * for k <= 22 that fits in 128 bits.  A candidate m / 10^k reads back as x
+ * when it's closer to x than half the gap to the next double, which is also
+ * a comparison of exact integers.  Any decimal of 15 significant digits or
+ * fewer survives a trip through a double, so if rounding x to 15 digits
+ * works, trimming its trailing zeros gives the shortest form.  Otherwise 16
+ * digits are tried, and 17 always work.
+ */
+static bool lbuf_shortest(double x, unsigned long long *digits, int *places)
+{
+	unsigned long long bits;
+	memcpy(&bits, &x, sizeof(bits));
+	int biased = (bits >> 52) & 0x7ff;
+	unsigned long long M = bits & ((1ULL << 52) - 1);
+	/* A power of two is twice as close to the double below it */
+	bool asym = (M == 0 && biased > 1);
+	bool even = !(bits & 1);
+	M |= 1ULL << 52;
+	int s = 1075 - biased;
+
+	if (x < 1e-6 || x >= 9007199254740992.0)
+		return false;
+
+	/* x is in [10^d, 10^(d+1)), give or take one until checked below */
+	int d = (int)floor(log10(x));
+
+	for (int p = 15; p <= 17; p++) {
+		int k = p - 1 - d;
+		if (k < 0)
+			k = 0;
+		unsigned __int128 ten_k = 1;
+		for (int i = 0; i < k; i++)
+			ten_k *= 10;
+		unsigned __int128 P = M * ten_k;
+		unsigned __int128 one = (unsigned __int128)1 << s;
+		unsigned __int128 rem = P & (one - 1);
+		unsigned long long m = (unsigned long long)(P >> s);
+
+		/* Fix up d if the integer part doesn't have p digits */
+		unsigned long long lo = (unsigned long long)lval_pow10[p - 1];
+		if (k > 0 && m >= lo * 10) {
+			d++;
+			p--;
+			continue;
+		}
+		if (m < lo && k + 1 <= LVAL_POW10_MAX) {
+			d--;
+			p--;
+			continue;
+		}
+
+		/* Round to nearest, and measure how far m is from x * 10^k */
+		unsigned __int128 diff = rem;
+		bool below = true;
+		if (rem > one - rem || (rem == one - rem && (m & 1))) {
+			m++;
+			diff = one - rem;
+			below = false;
+		}
+		unsigned __int128 err = (below && asym) ? diff * 4 : diff * 2;
+		if (p < 17 && !(err < ten_k || (even && err == ten_k)))
+			continue;
+
+		while (k > 0 && m % 10 == 0) {
+			m /= 10;
+			k--;
+		}
+		*digits = m;
+		*places = k;
+		return true;
+	}
+	return false;
+}
+#endif
+
+void lbuf_double(struct lbuf *b, double x)
+{
+	char d[32];
+	int n = 0;
+
+	if (isnan(x)) {
+		lbuf_puts(b, "nan");
+		return;
+	}
+	if (signbit(x)) {
+		lbuf_putc(b, '-');
+		x = -x;
+	}
+	if (isinf(x)) {
+		lbuf_puts(b, "inf");
+		return;
+	}
+	if (x == 0) {
+		lbuf_puts(b, "0.0");
+		return;
+	}
+
+#ifdef __SIZEOF_INT128__
+	unsigned long long m;
+	int k;
+	if (lbuf_shortest(x, &m, &k)) {
+		int i = sizeof(d);
+		do {
+			d[--i] = '0' + m % 10;
+			m /= 10;
+		} while (m);
+		n = sizeof(d) - i;
+		lbuf_fixed(b, d + i, n, n - k);
+		return;
+	}
+#endif
+
+	/*
+	 * Slow path for very large and very small values:  print 1, 2 and so
+	 * on up to 17 significant digits until the text reads back as x, for
+	 * the same reason as above.  Subnormals can need as few as one.
+	 */
+	char e[40];
+	for (int p = 1; p <= 17; p++) {
+		snprintf(e, sizeof(e), "%.*e", p - 1, x);
+		if (p == 17 || strtod(e, NULL) == x)
+			break;
+	}
+	/* e looks like "d.dddde+XX" */
+	char *exp = strchr(e, 'e');
+	d[n++] = e[0];
+	for (char *c = e + 2; c < exp; c++)
+		d[n++] = *c;
+	while (n > 1 && d[n - 1] == '0')
+		n--;
+	lbuf_fixed(b, d, n, atoi(exp + 1) + 1);
+}
+
+char *lbuf_take(struct lbuf *b)
+{
+	lbuf_putc(b, '\0');
+	if (b->data == b->fixed) {
+		char *s = malloc(b->len);
+		memcpy(s, b->data, b->len);
+		return s;
+	}
+	char *s = realloc(b->data, b->len);
+	lbuf_string(b);
+	return s;
+}
+
+/*
+ * Write n bytes in double quotes, escaped so that the reader reads them back
+ * as the same string.
+ */
+static void lbuf_quoted(struct lbuf *b, const char *s, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	lbuf_putc(b, '"');
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = s[i];
+		switch (c) {
+		case '"':
+			lbuf_write(b, "\\\"", 2);
+			break;
+		case '\\':
+			lbuf_write(b, "\\\\", 2);
+			break;
+		case '\n':
+			lbuf_write(b, "\\n", 2);
+			break;
+		case '\t':
+			lbuf_write(b, "\\t", 2);
+			break;
+		case '\r':
+			lbuf_write(b, "\\r", 2);
+			break;
+		default:
+			if (c < 0x20 || c == 0x7f) {
+				lbuf_write(b, "\\x", 2);
+				lbuf_putc(b, hex[c >> 4]);
+				lbuf_putc(b, hex[c & 0xf]);
+			} else {
+				lbuf_putc(b, c);
+			}
+		}
+	}
+	lbuf_putc(b, '"');
+}
+
+void lbuf_expr(struct lbuf *b, struct lval *v, char open, char close)
+{
+	lbuf_putc(b, open);
+	for (int i = 0; i < v->count; i++) {
+		lbuf_lval(b, v->cell[i]);
+		/* Don't print trailing space if last element */
+		if (i != (v->count-1))
+			lbuf_putc(b, ' ');
+	}
+	lbuf_putc(b, close);
+}
+
+void lbuf_lval(struct lbuf *b, struct lval *v)
+{
+	switch (v->type) {
+	case LVAL_LONG:
+		lbuf_long(b, v->val.num_long);
+		break;
+	case LVAL_DOUBLE:
+		lbuf_double(b, v->val.num_double);
+		break;
+	case LVAL_ERR:
+		lbuf_puts(b, "Runtime Error: ");
+		lbuf_puts(b, v->val.err);
+		break;
+	case LVAL_SYM:
+		lbuf_puts(b, v->val.sym);
+		break;
+	case LVAL_SEXPR:
+		lbuf_expr(b, v, '(', ')');
+		break;
+	case LVAL_FUNC:
+		/*
+		 * TODO(jfriedly):  Figure out a way to make this print the
+		 * name of the function.
+		 */
+		if (v->val.func.builtin) {
+			char tmp[64];
+			snprintf(tmp, sizeof(tmp), "<builtin function at %p>",
+				v->val.func.builtin);
+			lbuf_puts(b, tmp);
+		} else {
+			lbuf_puts(b, "(lambda ");
+			lbuf_lval(b, v->val.func.formals);
+			lbuf_putc(b, ' ');
+			lbuf_lval(b, v->val.func.body);
+			lbuf_putc(b, ')');
+		}
+		break;
+	case LVAL_BOOL:
+		lbuf_putc(b, v->val.b ? 'T' : 'F');
+		break;
+	case LVAL_PORT:
+		lbuf_puts(b, "<port ");
+		lbuf_puts(b, v->val.port->path);
+		lbuf_putc(b, '>');
+		break;
+	case LVAL_STRING:
+		lbuf_quoted(b, LVAL_STR(v), v->val.str.len);
+		break;
+	case LVAL_BYTES:
+		/* There's no syntax for bytes, so they can't be read back */
+		lbuf_puts(b, "<bytes ");
+		lbuf_quoted(b, LVAL_STR(v), v->val.str.len);
+		lbuf_putc(b, '>');
+		break;
+	case LVAL_HASHMAP: {
+		/* Printed as its entries, which can't be read back either */
+		size_t i = 0;
+		struct lhash_entry *e;
+		lbuf_puts(b, "<hashmap");
+		lhash_lock(v->val.hash);
+		while ((e = lhash_next(v->val.hash, &i)) != NULL) {
+			lbuf_puts(b, " (");
+			lbuf_lval(b, e->key);
+			lbuf_putc(b, ' ');
+			lbuf_lval(b, e->val);
+			lbuf_putc(b, ')');
+		}
+		lhash_unlock(v->val.hash);
+		lbuf_putc(b, '>');
+		break;
+	}
+	case LVAL_VECTOR: {
+		struct lvec *vec = v->val.vec.vec;
+		lbuf_putc(b, '[');
+		for (size_t i = v->val.vec.start; i < vec->count; i++) {
+			if (i != v->val.vec.start)
+				lbuf_putc(b, ' ');
+			lbuf_lval(b, lvec_nth(vec, i));
+		}
+		lbuf_putc(b, ']');
+		break;
+	}
+	case LVAL_ISOLATE:
+		lbuf_puts(b, "<isolate ");
+		lbuf_puts(b, lisolate_path(v->val.iso));
+		lbuf_putc(b, '>');
+		break;
+	case LVAL_FUTURE:
+		lbuf_puts(b, "<future>");
+		break;
+	case LVAL_CHANNEL:
+		lbuf_puts(b, "<channel>");
+		break;
+	case LVAL_TASK:
+		lbuf_puts(b, "<task>");
+		break;
+	default:
+		/* There's a bug if this ever doesn't print Unknown. */
+		log_err("Attempted to print an unrecognized lval type %s.",
+			ltype(v->type));
+	}
+}
+
+void lval_expr_print(FILE *stream, struct lval *v, char open, char close)
+{
+	struct lbuf b;
+	lbuf_file(&b, stream);
+	lbuf_expr(&b, v, open, close);
+	lbuf_flush(&b);
+}
+
+void lval_print(FILE *stream, struct lval *v)
+{
+	struct lbuf b;
+	lbuf_file(&b, stream);
+	lbuf_lval(&b, v);
+	lbuf_flush(&b);
+}
+
+void lval_println(FILE *stream, struct lval *v)
+{
+	struct lbuf b;
+	lbuf_file(&b, stream);
+	lbuf_lval(&b, v);
+	lbuf_putc(&b, '\n');
+	lbuf_flush(&b);
+}
+
+char *lval_to_string(struct lval *v)
+{
+	struct lbuf b;
+	lbuf_string(&b);
+	lbuf_lval(&b, v);
+	return lbuf_take(&b);
+}
+
+struct lval *builtin_to_string(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "to-string");
+	struct lval *arg1 = lval_take(args, 0);
+
+	/* Strings are already strings, and bytes share their buffer */
+	if (arg1->type == LVAL_STRING || arg1->type == LVAL_BYTES) {
+		arg1->type = LVAL_STRING;
+		return arg1;
+	}
+
+	struct lbuf b;
+	lbuf_string(&b);
+	lbuf_lval(&b, arg1);
+	struct lval *result = lval_string(b.data, b.len);
+	if (b.data != b.fixed)
+		free(b.data);
+	lval_del(arg1);
+	return result;
+}
@@ -0,0 +1,226 @@
+/* clock_gettime is POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * A quota bounds how much an evaluation can do:  how many times lval_eval
+ * is called, how many bytes of values it allocates, and how long it runs
+ * for.  Once it's passed any of them, every call to lval_eval under it
+ * returns an error straight away, so the evaluation unwinds like it would
+ * for any other error, freeing everything on the way out.
+ *
+ * Counting is done on each thread by itself, and added to the quota every
+ * LQUOTA_BATCH steps or LQUOTA_FLUSH bytes, which is also when the limits
+ * and the clock are checked.  Bytes are checked sooner if they might pass
+ * the limit, so lval_call can replace the result of a builtin that passed
+ * it with the error.  Waits for pipes, channels and the like end at the
+ * deadline.  Tasks, futures and pmaps take the quota of whatever started
+ * them, so work can't escape it by going elsewhere.
+ */
+
+/* Steps, and bytes allocated, between checks */
+#define LQUOTA_BATCH 1024
+#define LQUOTA_FLUSH (64 * 1024)
+
+enum {
+	LQUOTA_OK,
+	LQUOTA_STEPS,
+	LQUOTA_BYTES,
+	LQUOTA_TIME,
+};
+
+struct lquota {
+	int refs;
+	/* The limits, or 0 for none */
+	long max_steps;
+	long max_bytes;
+	long max_ms;
+	/* When it runs out of time, in nanoseconds on the monotonic clock */
+	long long deadline;
+	/* Used so far, on every thread */
+	long steps;
+	long bytes;
+	/* Which limit it passed, once it has */
+	int over;
+};
+
+/* The quota this thread is evaluating under, or NULL */
+static __thread struct lquota *lquota_current;
+/* Steps and bytes not added to it yet, and the step to check at */
+static __thread long lquota_steps;
+static __thread long lquota_bytes;
+static __thread long lquota_next;
+/* The bytes to check at, and whether it had passed at the last check */
+static __thread long lquota_room;
+static __thread bool lquota_passed;
+
+static long long lquota_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct lquota *lquota_new(long max_steps, long max_bytes, long max_ms)
+{
+	struct lquota *q = malloc(sizeof(struct lquota));
+	q->refs = 1;
+	q->max_steps = max_steps;
+	q->max_bytes = max_bytes;
+	q->max_ms = max_ms;
+	q->deadline = max_ms > 0 ? lquota_now() + max_ms * 1000000LL : 0;
+	q->steps = 0;
+	q->bytes = 0;
+	q->over = LQUOTA_OK;
+	return q;
+}
+
+void lquota_retain(struct lquota *q)
+{
+	if (q != NULL)
+		LREF_RETAIN(q->refs);
+}
+
+void lquota_release(struct lquota *q)
+{
+	if (q != NULL && LREF_RELEASE(q->refs) == 0)
+		free(q);
+}
+
+struct lquota *lquota_get(void)
+{
+	return lquota_current;
+}
+
+/* Add what this thread has counted to its quota */
+static void lquota_flush(void)
+{
+	struct lquota *q = lquota_current;
+	if (q != NULL) {
+		__atomic_add_fetch(&q->steps, lquota_steps, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&q->bytes, lquota_bytes, __ATOMIC_RELAXED);
+	}
+	lquota_steps = 0;
+	lquota_bytes = 0;
+}
+
+struct lquota *lquota_swap(struct lquota *q)
+{
+	lquota_flush();
+	struct lquota *prev = lquota_current;
+	lquota_current = q;
+	/* Check the new one on the next step */
+	lquota_next = 0;
+	lquota_room = 0;
+	lquota_passed = false;
+	return prev;
+}
+
+/* Flush and check the limits, and decide when to check next */
+bool lquota_check(void)
+{
+	struct lquota *q = lquota_current;
+	if (q == NULL) {
+		lquota_steps = 0;
+		lquota_bytes = 0;
+		lquota_next = LONG_MAX;
+		lquota_room = LONG_MAX;
+		return true;
+	}
+
+	long steps = __atomic_add_fetch(&q->steps, lquota_steps,
+		__ATOMIC_RELAXED);
+	long bytes = __atomic_add_fetch(&q->bytes, lquota_bytes,
+		__ATOMIC_RELAXED);
+	lquota_steps = 0;
+	lquota_bytes = 0;
+
+	int over = __atomic_load_n(&q->over, __ATOMIC_RELAXED);
+	if (over == LQUOTA_OK) {
+		if (q->max_steps > 0 && steps > q->max_steps)
+			over = LQUOTA_STEPS;
+		else if (q->max_bytes > 0 && bytes > q->max_bytes)
+			over = LQUOTA_BYTES;
+		else if (q->deadline > 0 && lquota_now() > q->deadline)
+			over = LQUOTA_TIME;
+		if (over != LQUOTA_OK)
+			__atomic_store_n(&q->over, over, __ATOMIC_RELAXED);
+	}
+	if (over != LQUOTA_OK) {
+		lquota_next = 0;
+		lquota_room = 0;
+		lquota_passed = true;
+		return false;
+	}
+
+	/* Stop on exactly the step after the last one allowed */
+	lquota_next = LQUOTA_BATCH;
+	if (q->max_steps > 0 && q->max_steps - steps < LQUOTA_BATCH)
+		lquota_next = q->max_steps - steps + 1;
+	/* And on the allocation that takes it past the limit on bytes */
+	lquota_room = LQUOTA_FLUSH;
+	if (q->max_bytes > 0 && q->max_bytes - bytes < LQUOTA_FLUSH)
+		lquota_room = q->max_bytes - bytes + 1;
+	return true;
+}
+
+bool lquota_step(void)
+{
+	if (++lquota_steps < lquota_next)
+		return true;
+	return lquota_check();
+}
+
+bool lquota_alloc(size_t n)
+{
+	if (lquota_current == NULL)
+		return true;
+	if (lquota_passed)
+		return false;
+	lquota_bytes += n;
+	if (lquota_bytes >= lquota_room)
+		return lquota_check();
+	return true;
+}
+
+bool lquota_over(void)
+{
+	return lquota_passed;
+}
+
+long long lquota_deadline(void)
+{
+	struct lquota *q = lquota_current;
+	if (q == NULL || q->deadline == 0)
+		return 0;
+	/* Late rather than early, so it's passed by the time a timer goes off */
+	return (q->deadline + 999999) / 1000000 + 1;
+}
+
+struct lval *lquota_err(void)
+{
+	struct lquota *q = lquota_current;
+	switch (q == NULL ? LQUOTA_OK : q->over) {
+	case LQUOTA_STEPS:
+		return lval_err("Evaluation passed its limit of %ld steps.",
+			q->max_steps);
+	case LQUOTA_BYTES:
+		return lval_err("Evaluation passed its limit of %ld bytes.",
+			q->max_bytes);
+	case LQUOTA_TIME:
+		return lval_err("Evaluation passed its limit of %ld "
+			"milliseconds.", q->max_ms);
+	default:
+		return lval_err("Evaluation passed its quota.");
+	}
+}
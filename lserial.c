@@ -0,0 +1,677 @@
+/* mmap, open and fstat are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Binary format
+ *
+ * A file starts with the 4 byte magic "MYLB" and a 4 byte little endian
+ * version, followed by one encoded value.  Every value is a 1 byte tag and
+ * its payload, with all integers little endian:
+ *
+ *	LSERIAL_LONG	8 byte two's complement
+ *	LSERIAL_DOUBLE	8 byte IEEE 754 bits
+ *	LSERIAL_ERR,
+ *	LSERIAL_SYM	4 byte length, the bytes, then a NUL
+ *	LSERIAL_SEXPR	4 byte count, 4 byte size of the children in bytes,
+ *			then the children
+ *	LSERIAL_TRUE,
+ *	LSERIAL_FALSE	nothing
+ *	LSERIAL_BUILTIN	the builtin's name, encoded like a symbol
+ *	LSERIAL_LAMBDA	4 byte count of bound variables, then for each one its
+ *			name encoded like a symbol and its value, then the
+ *			formals and body
+ *	LSERIAL_ENV	4 byte count of bindings, encoded like the bound
+ *			variables of a lambda
+ *	LSERIAL_STRING,
+ *	LSERIAL_BYTES	encoded like a symbol, but may contain NULs
+ *	LSERIAL_HASHMAP	4 byte count of entries, then each key and its value
+ *	LSERIAL_VECTOR	4 byte count, then the elements
+ *
+ * Strings are stored NUL terminated and S-expressions record their size, so
+ * a mapped file can be walked and subtrees skipped in place.  Builtins are
+ * stored by the name they're bound to in the global environment and looked
+ * up again by name when loading.
+ *
+ * An image is a file holding a single LSERIAL_ENV, the global environment
+ * saved by save-image.  Nothing in the format is a pointer, so an image can
+ * be loaded at any address, by any build that has the same builtins.
+ */
+enum {
+	LSERIAL_LONG = 1,
+	LSERIAL_DOUBLE,
+	LSERIAL_ERR,
+	LSERIAL_SYM,
+	LSERIAL_SEXPR,
+	LSERIAL_TRUE,
+	LSERIAL_FALSE,
+	LSERIAL_BUILTIN,
+	LSERIAL_LAMBDA,
+	LSERIAL_ENV,
+	LSERIAL_STRING,
+	LSERIAL_BYTES,
+	LSERIAL_HASHMAP,
+	LSERIAL_VECTOR,
+};
+
+#define LSERIAL_MAGIC "MYLB"
+#define LSERIAL_HEADER_SIZE 8
+/*
+ * Values nested deeper than this aren't read, since reading recurses once
+ * per level and a crafted file could otherwise overflow the stack
+ */
+#define LSERIAL_DEPTH 10000
+
+static void lserial_u32(struct lbuf *b, uint32_t x)
+{
+	char bytes[4];
+	for (int i = 0; i < 4; i++)
+		bytes[i] = (x >> (8 * i)) & 0xff;
+	lbuf_write(b, bytes, 4);
+}
+
+static void lserial_u64(struct lbuf *b, uint64_t x)
+{
+	char bytes[8];
+	for (int i = 0; i < 8; i++)
+		bytes[i] = (x >> (8 * i)) & 0xff;
+	lbuf_write(b, bytes, 8);
+}
+
+static void lserial_bytes(struct lbuf *b, char tag, const char *s, size_t n)
+{
+	lbuf_putc(b, tag);
+	lserial_u32(b, n);
+	lbuf_write(b, s, n);
+	lbuf_putc(b, '\0');
+}
+
+static void lserial_str(struct lbuf *b, char tag, char *s)
+{
+	lserial_bytes(b, tag, s, strlen(s));
+}
+
+/* Find the name a builtin is bound to in the global environment */
+static char *lserial_builtin_name(struct lenv *env,
+	struct lval *(*builtin)(struct lenv *env, struct lval *v))
+{
+	while (env->parent)
+		env = env->parent;
+	for (int i = 0; i < env->count; i++) {
+		if (env->vals[i]->type == LVAL_FUNC &&
+			env->vals[i]->val.func.builtin == builtin)
+			return env->syms[i];
+	}
+	return NULL;
+}
+
+void lserial_header(struct lbuf *b)
+{
+	lbuf_write(b, LSERIAL_MAGIC, 4);
+	lserial_u32(b, LSERIAL_VERSION);
+}
+
+/* Append the count of bindings in e, then each name and value */
+static bool lserial_write_bindings(struct lbuf *b, struct lenv *env,
+	struct lenv *e)
+{
+	lserial_u32(b, e->count);
+	for (int i = 0; i < e->count; i++) {
+		lserial_str(b, LSERIAL_SYM, e->syms[i]);
+		if (!lserial_write(b, env, e->vals[i]))
+			return false;
+	}
+	return true;
+}
+
+void lserial_write_env(struct lbuf *b, struct lenv *env)
+{
+	lbuf_putc(b, LSERIAL_ENV);
+	/* The count is filled in once it's known what could be written */
+	size_t at = b->len;
+	uint32_t count = 0;
+	lserial_u32(b, 0);
+	for (int i = 0; i < env->count; i++) {
+		size_t mark = b->len;
+		lserial_str(b, LSERIAL_SYM, env->syms[i]);
+		if (lserial_write(b, env, env->vals[i])) {
+			count++;
+			continue;
+		}
+		b->len = mark;
+		fprintf(stderr, "Not saving %s, which holds a %s or something "
+			"else that can't be saved\n", env->syms[i],
+			ltype(env->vals[i]->type));
+	}
+	for (int i = 0; i < 4; i++)
+		b->data[at + i] = (count >> (8 * i)) & 0xff;
+}
+
+bool lserial_write(struct lbuf *b, struct lenv *env, struct lval *v)
+{
+	uint64_t bits;
+
+	switch (v->type) {
+	case LVAL_LONG:
+		lbuf_putc(b, LSERIAL_LONG);
+		lserial_u64(b, (uint64_t)v->val.num_long);
+		break;
+	case LVAL_DOUBLE:
+		memcpy(&bits, &v->val.num_double, sizeof(bits));
+		lbuf_putc(b, LSERIAL_DOUBLE);
+		lserial_u64(b, bits);
+		break;
+	case LVAL_ERR:
+		lserial_str(b, LSERIAL_ERR, v->val.err);
+		break;
+	case LVAL_SYM:
+		lserial_str(b, LSERIAL_SYM, v->val.sym);
+		break;
+	case LVAL_SEXPR: {
+		/* The size isn't known until the children are written */
+		size_t at = b->len;
+		lbuf_putc(b, LSERIAL_SEXPR);
+		lserial_u32(b, v->count);
+		lserial_u32(b, 0);
+		size_t start = b->len;
+		for (int i = 0; i < v->count; i++) {
+			if (!lserial_write(b, env, v->cell[i]))
+				return false;
+		}
+		uint32_t size = b->len - start;
+		for (int i = 0; i < 4; i++)
+			b->data[at + 5 + i] = (size >> (8 * i)) & 0xff;
+		break;
+	}
+	case LVAL_BOOL:
+		lbuf_putc(b, v->val.b ? LSERIAL_TRUE : LSERIAL_FALSE);
+		break;
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		if (v->val.str.len > UINT32_MAX)
+			return false;
+		lserial_bytes(b, v->type == LVAL_STRING ? LSERIAL_STRING :
+			LSERIAL_BYTES, LVAL_STR(v), v->val.str.len);
+		break;
+	case LVAL_HASHMAP: {
+		size_t i = 0;
+		struct lhash_entry *e;
+		bool ok = true;
+		lbuf_putc(b, LSERIAL_HASHMAP);
+		lhash_lock(v->val.hash);
+		lserial_u32(b, lhash_count(v->val.hash));
+		while (ok && (e = lhash_next(v->val.hash, &i)) != NULL) {
+			ok = lserial_write(b, env, e->key) &&
+				lserial_write(b, env, e->val);
+		}
+		lhash_unlock(v->val.hash);
+		if (!ok)
+			return false;
+		break;
+	}
+	case LVAL_VECTOR: {
+		struct lvec *vec = v->val.vec.vec;
+		lbuf_putc(b, LSERIAL_VECTOR);
+		lserial_u32(b, vec->count - v->val.vec.start);
+		for (size_t i = v->val.vec.start; i < vec->count; i++) {
+			if (!lserial_write(b, env, lvec_nth(vec, i)))
+				return false;
+		}
+		break;
+	}
+	case LVAL_FUNC:
+		if (v->val.func.builtin) {
+			char *name = lserial_builtin_name(env,
+				v->val.func.builtin);
+			if (name == NULL)
+				return false;
+			lserial_str(b, LSERIAL_BUILTIN, name);
+			break;
+		}
+		lbuf_putc(b, LSERIAL_LAMBDA);
+		if (!lserial_write_bindings(b, env, v->val.func.env))
+			return false;
+		if (!lserial_write(b, env, v->val.func.formals))
+			return false;
+		if (!lserial_write(b, env, v->val.func.body))
+			return false;
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+/* A position in an encoded buffer, and the end it mustn't read past */
+struct lserial_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	struct lenv *env;
+	/* How deeply nested the value being read is, and if it's too deep */
+	int depth;
+	bool too_deep;
+};
+
+static bool lserial_read_u32(struct lserial_reader *r, uint32_t *x)
+{
+	if (r->end - r->p < 4)
+		return false;
+	*x = 0;
+	for (int i = 0; i < 4; i++)
+		*x |= (uint32_t)r->p[i] << (8 * i);
+	r->p += 4;
+	return true;
+}
+
+static bool lserial_read_u64(struct lserial_reader *r, uint64_t *x)
+{
+	if (r->end - r->p < 8)
+		return false;
+	*x = 0;
+	for (int i = 0; i < 8; i++)
+		*x |= (uint64_t)r->p[i] << (8 * i);
+	r->p += 8;
+	return true;
+}
+
+/* Returns a pointer to the NUL terminated string in place, and its length */
+static char *lserial_read_bytes(struct lserial_reader *r, uint32_t *n)
+{
+	if (!lserial_read_u32(r, n) || (size_t)(r->end - r->p) <= *n ||
+		r->p[*n] != '\0')
+		return NULL;
+	char *s = (char *)r->p;
+	r->p += *n + 1;
+	return s;
+}
+
+static char *lserial_read_str(struct lserial_reader *r)
+{
+	uint32_t n;
+	return lserial_read_bytes(r, &n);
+}
+
+static bool lserial_read_bindings(struct lserial_reader *r, struct lenv *e);
+static struct lval *lserial_read(struct lserial_reader *r);
+
+static struct lval *lserial_read_value(struct lserial_reader *r)
+{
+	uint64_t bits;
+	uint32_t n, size;
+	char *s;
+
+	if (r->p >= r->end)
+		return NULL;
+
+	switch (*r->p++) {
+	case LSERIAL_LONG:
+		if (!lserial_read_u64(r, &bits))
+			return NULL;
+		return lval_long((long)bits);
+	case LSERIAL_DOUBLE: {
+		double x;
+		if (!lserial_read_u64(r, &bits))
+			return NULL;
+		memcpy(&x, &bits, sizeof(x));
+		return lval_double(x);
+	}
+	case LSERIAL_ERR:
+		if ((s = lserial_read_str(r)) == NULL)
+			return NULL;
+		return lval_err("%s", s);
+	case LSERIAL_SYM:
+		if ((s = lserial_read_str(r)) == NULL)
+			return NULL;
+		return lval_sym(s);
+	case LSERIAL_SEXPR: {
+		/* Every child takes at least a byte */
+		if (!lserial_read_u32(r, &n) || !lserial_read_u32(r, &size) ||
+			(size_t)(r->end - r->p) < size || n > size)
+			return NULL;
+		const unsigned char *end = r->p + size;
+		struct lval *sexpr = lval_sexpr();
+		sexpr->cell = malloc(sizeof(struct lval*) * n);
+		for (uint32_t i = 0; i < n; i++) {
+			struct lval *x = lserial_read(r);
+			if (x == NULL || r->p > end) {
+				if (x)
+					lval_del(x);
+				lval_del(sexpr);
+				return NULL;
+			}
+			sexpr->cell[sexpr->count++] = x;
+		}
+		if (r->p != end) {
+			lval_del(sexpr);
+			return NULL;
+		}
+		return sexpr;
+	}
+	case LSERIAL_STRING:
+		if ((s = lserial_read_bytes(r, &n)) == NULL)
+			return NULL;
+		return lval_string(s, n);
+	case LSERIAL_BYTES:
+		if ((s = lserial_read_bytes(r, &n)) == NULL)
+			return NULL;
+		return lval_bytes(s, n);
+	case LSERIAL_HASHMAP: {
+		/* Every entry takes at least two bytes */
+		if (!lserial_read_u32(r, &n) || (size_t)(r->end - r->p) / 2 < n)
+			return NULL;
+		struct lhash *h = lhash_new();
+		for (uint32_t i = 0; i < n; i++) {
+			uint64_t hash;
+			struct lval *k = lserial_read(r);
+			struct lval *v = k ? lserial_read(r) : NULL;
+			if (v == NULL || !lhash_key(k, &hash)) {
+				if (k)
+					lval_del(k);
+				if (v)
+					lval_del(v);
+				lhash_release(h);
+				return NULL;
+			}
+			lhash_put(h, k, hash, v);
+		}
+		return lval_hashmap(h);
+	}
+	case LSERIAL_VECTOR: {
+		if (!lserial_read_u32(r, &n) || (size_t)(r->end - r->p) < n)
+			return NULL;
+		struct lvec *vec = lvec_new();
+		for (uint32_t i = 0; i < n; i++) {
+			struct lval *x = lserial_read(r);
+			if (x == NULL) {
+				lvec_release(vec);
+				return NULL;
+			}
+			struct lvec *next = lvec_conj(vec, x);
+			lvec_release(vec);
+			vec = next;
+		}
+		return lval_vector(vec, 0);
+	}
+	case LSERIAL_TRUE:
+		return lval_bool(true);
+	case LSERIAL_FALSE:
+		return lval_bool(false);
+	case LSERIAL_BUILTIN: {
+		if ((s = lserial_read_str(r)) == NULL)
+			return NULL;
+		struct lval *k = lval_sym(s);
+		struct lval *f = lenv_get(r->env, k);
+		lval_del(k);
+		if (f->type != LVAL_FUNC || !f->val.func.builtin) {
+			lval_del(f);
+			return NULL;
+		}
+		return f;
+	}
+	case LSERIAL_LAMBDA: {
+		struct lenv *bound = lenv_new();
+		if (!lserial_read_bindings(r, bound)) {
+			lenv_del(bound);
+			return NULL;
+		}
+		struct lval *formals = lserial_read(r);
+		struct lval *body = formals ? lserial_read(r) : NULL;
+		if (body == NULL) {
+			if (formals)
+				lval_del(formals);
+			lenv_del(bound);
+			return NULL;
+		}
+		struct lval *f = lval_lambda(formals, body);
+		lenv_del(f->val.func.env);
+		f->val.func.env = bound;
+		return f;
+	}
+	default:
+		return NULL;
+	}
+}
+
+/* Read one value, or return NULL if it's malformed or nested too deeply */
+static struct lval *lserial_read(struct lserial_reader *r)
+{
+	if (r->depth >= LSERIAL_DEPTH) {
+		r->too_deep = true;
+		return NULL;
+	}
+	r->depth++;
+	struct lval *v = lserial_read_value(r);
+	r->depth--;
+	return v;
+}
+
+/*
+ * Read a count of bindings, then each name and value, and bind them in e.
+ * Returns false if the data is malformed, leaving whatever was bound so far.
+ */
+static bool lserial_read_bindings(struct lserial_reader *r, struct lenv *e)
+{
+	uint32_t n;
+	char *s;
+
+	if (!lserial_read_u32(r, &n))
+		return false;
+	for (uint32_t i = 0; i < n; i++) {
+		if (r->p >= r->end || *r->p++ != LSERIAL_SYM ||
+			(s = lserial_read_str(r)) == NULL)
+			return false;
+		struct lval *v = lserial_read(r);
+		if (v == NULL)
+			return false;
+		struct lval *k = lval_sym(s);
+		lenv_let(e, k, v);
+		lval_del(k);
+		lval_del(v);
+	}
+	return true;
+}
+
+/* Check the header of data and point r just past it, or return an error */
+static struct lval *lserial_open(struct lserial_reader *r, struct lenv *env,
+	const char *data, size_t len)
+{
+	if (len < LSERIAL_HEADER_SIZE || memcmp(data, LSERIAL_MAGIC, 4) != 0)
+		return lval_err("Not a binary lval file");
+
+	uint32_t version = 0;
+	r->p = (const unsigned char *)data + 4;
+	r->end = (const unsigned char *)data + len;
+	r->env = env;
+	r->depth = 0;
+	r->too_deep = false;
+	lserial_read_u32(r, &version);
+	if (version != LSERIAL_VERSION)
+		return lval_err("Unsupported binary lval version %u", version);
+	return NULL;
+}
+
+struct lval *lserial_decode(struct lenv *env, const char *data, size_t len)
+{
+	struct lserial_reader r;
+	struct lval *err = lserial_open(&r, env, data, len);
+	if (err)
+		return err;
+
+	struct lval *v = lserial_read(&r);
+	if (v == NULL && r.too_deep)
+		return lval_err("Binary lval data is nested more than %d deep",
+			LSERIAL_DEPTH);
+	if (v == NULL)
+		return lval_err("Corrupt binary lval data");
+	if (r.p != r.end) {
+		lval_del(v);
+		return lval_err("Trailing data after binary lval");
+	}
+	return v;
+}
+
+struct lval *lserial_decode_env(struct lenv *env, const char *data,
+	size_t len)
+{
+	struct lserial_reader r;
+	struct lval *err = lserial_open(&r, env, data, len);
+	if (err)
+		return err;
+
+	if (r.p >= r.end || *r.p++ != LSERIAL_ENV ||
+		!lserial_read_bindings(&r, env))
+		return r.too_deep ? lval_err("Image is nested more than %d deep",
+			LSERIAL_DEPTH) : lval_err("Corrupt image");
+	if (r.p != r.end)
+		return lval_err("Trailing data after image");
+	return lval_sexpr();
+}
+
+struct lval *lserial_load_image(struct lenv *env, char *path)
+{
+	size_t len;
+	const char *data = lserial_map(path, &len);
+	if (data == NULL)
+		return lval_err("Could not read %s:  %s", path, strerror(errno));
+
+	struct lval *v = lserial_decode_env(env, data, len);
+	lserial_unmap(data, len);
+	return v;
+}
+
+const char *lserial_map(char *path, size_t *len)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* mmap refuses to map nothing */
+	if (st.st_size == 0) {
+		close(fd);
+		*len = 0;
+		return "";
+	}
+
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return data;
+}
+
+void lserial_unmap(const char *data, size_t len)
+{
+	if (len > 0)
+		munmap((void *)data, len);
+}
+
+char *lval_path(struct lval *v)
+{
+	if (v->type == LVAL_SYM)
+		return v->val.sym;
+	if (v->type == LVAL_STRING)
+		return lval_cstr(v);
+	return NULL;
+}
+
+/* Write out and free the contents of a string lbuf.  Sets errno on failure */
+static bool lserial_write_file(char *path, struct lbuf *b)
+{
+	size_t len = b->len;
+	char *data = lbuf_take(b);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		free(data);
+		return false;
+	}
+	bool ok = fwrite(data, 1, len, f) == len;
+	ok = (fclose(f) == 0) && ok;
+	free(data);
+	return ok;
+}
+
+struct lval *builtin_dump(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "dump");
+	char *path = lval_path(args->cell[1]);
+	LASSERT(args, path != NULL,
+		"Function dump passed incorrect type for the path.  Got %s.",
+		ltype(args->cell[1]->type));
+
+	struct lbuf b;
+	lbuf_string(&b);
+	lserial_header(&b);
+	if (!lserial_write(&b, env, args->cell[0])) {
+		free(lbuf_take(&b));
+		LASSERT(args, false, "Could not dump %s",
+			ltype(args->cell[0]->type));
+	}
+	LASSERT(args, lserial_write_file(path, &b), "Could not write %s:  %s",
+		path, strerror(errno));
+
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_save_image(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "save-image");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function save-image passed incorrect type for the path.  "
+		"Got %s.", ltype(args->cell[0]->type));
+
+	while (env->parent)
+		env = env->parent;
+
+	struct lbuf b;
+	lbuf_string(&b);
+	lserial_header(&b);
+	lserial_write_env(&b, env);
+	LASSERT(args, lserial_write_file(path, &b), "Could not write %s:  %s",
+		path, strerror(errno));
+
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_load_binary(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "load-binary");
+	char *path = lval_path(args->cell[0]);
+	LASSERT(args, path != NULL,
+		"Function load-binary passed incorrect type for the path.  "
+		"Got %s.", ltype(args->cell[0]->type));
+
+	size_t len;
+	const char *data = lserial_map(path, &len);
+	LASSERT(args, data != NULL, "Could not read %s:  %s", path,
+		strerror(errno));
+
+	struct lval *v = lserial_decode(env, data, len);
+	lserial_unmap(data, len);
+	lval_del(args);
+	return v;
+}
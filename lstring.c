@@ -0,0 +1,241 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+struct lstr *lstr_new(size_t cap)
+{
+	lquota_alloc(sizeof(struct lstr) + cap);
+	struct lstr *s = malloc(sizeof(struct lstr) + cap);
+	s->refs = 1;
+	s->len = 0;
+	s->cap = cap;
+	s->data[0] = '\0';
+	return s;
+}
+
+void lstr_retain(struct lstr *s)
+{
+	LREF_RETAIN(s->refs);
+}
+
+void lstr_release(struct lstr *s)
+{
+	if (LREF_RELEASE(s->refs) == 0)
+		free(s);
+}
+
+struct lval *lval_str_view(int type, struct lstr *buf, size_t off,
+	size_t len)
+{
+	struct lval *v = lval_alloc();
+	v->type = type;
+	v->val.str.buf = buf;
+	v->val.str.off = off;
+	v->val.str.len = len;
+	return v;
+}
+
+static struct lval *lval_str_copy(int type, const char *s, size_t n)
+{
+	struct lstr *buf = lstr_new(n + 1);
+	memcpy(buf->data, s, n);
+	buf->data[n] = '\0';
+	buf->len = n;
+	return lval_str_view(type, buf, 0, n);
+}
+
+struct lval *lval_string(const char *s, size_t n)
+{
+	return lval_str_copy(LVAL_STRING, s, n);
+}
+
+struct lval *lval_bytes(const char *s, size_t n)
+{
+	return lval_str_copy(LVAL_BYTES, s, n);
+}
+
+/*
+ * Claim the n bytes after v's view in its buffer, if the view ends where the
+ * buffer does and there's room.  Views on other threads can share the
+ * buffer, so the end only moves with a compare and swap, and whichever view
+ * moves it first gets to append there.
+ */
+static bool lval_str_claim(struct lval *v, size_t n)
+{
+	struct lstr *buf = v->val.str.buf;
+	size_t end = v->val.str.off + v->val.str.len;
+	if (end + n >= buf->cap)
+		return false;
+	return __atomic_compare_exchange_n(&buf->len, &end, end + n, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Move v to a new buffer twice the size it needs to append n more bytes */
+static void lval_str_move(struct lval *v, size_t n)
+{
+	size_t len = v->val.str.len;
+	size_t cap = 2 * (len + n) + 1;
+	if (cap < 32)
+		cap = 32;
+	struct lstr *grown = lstr_new(cap);
+	memcpy(grown->data, LVAL_STR(v), len);
+	grown->data[len] = '\0';
+	grown->len = len;
+	lstr_release(v->val.str.buf);
+	v->val.str.buf = grown;
+	v->val.str.off = 0;
+}
+
+/*
+ * Make sure n more bytes can most likely be appended to v in place.  If v's
+ * view doesn't end at the end of its buffer, or the buffer is full, it's
+ * moved to a new buffer.
+ */
+static void lval_str_reserve(struct lval *v, size_t n)
+{
+	struct lstr *buf = v->val.str.buf;
+	size_t end = v->val.str.off + v->val.str.len;
+	if (end != __atomic_load_n(&buf->len, __ATOMIC_RELAXED) ||
+		end + n >= buf->cap)
+		lval_str_move(v, n);
+}
+
+struct lval *lval_str_append(struct lval *v, const char *s, size_t n)
+{
+	/*
+	 * s may point into v's own buffer, which stays valid since moving
+	 * only releases it.
+	 */
+	struct lstr *old = v->val.str.buf;
+	lstr_retain(old);
+	while (!lval_str_claim(v, n))
+		lval_str_move(v, n);
+
+	/* Nothing's terminated here, since the bytes after are someone else's */
+	memcpy(LVAL_STR(v) + v->val.str.len, s, n);
+	v->val.str.len += n;
+	lstr_release(old);
+	return v;
+}
+
+char *lval_cstr(struct lval *v)
+{
+	/* Nothing else can append to a buffer only v has, so cut it off */
+	struct lstr *buf = v->val.str.buf;
+	if (__atomic_load_n(&buf->refs, __ATOMIC_ACQUIRE) == 1) {
+		buf->len = v->val.str.off + v->val.str.len;
+		buf->data[buf->len] = '\0';
+		return LVAL_STR(v);
+	}
+
+	struct lstr *copy = lstr_new(v->val.str.len + 1);
+	memcpy(copy->data, LVAL_STR(v), v->val.str.len);
+	copy->len = v->val.str.len;
+	copy->data[copy->len] = '\0';
+	lstr_release(buf);
+	v->val.str.buf = copy;
+	v->val.str.off = 0;
+	return copy->data;
+}
+
+#define LASSERT_STR(args, i, func_name) \
+	LASSERT(args, args->cell[i]->type == LVAL_STRING || \
+		args->cell[i]->type == LVAL_BYTES, \
+		"Function %s passed incorrect type.  Got %s.  " \
+		"Expected %s or %s.", func_name, ltype(args->cell[i]->type), \
+		ltype(LVAL_STRING), ltype(LVAL_BYTES));
+
+/* True if the ith argument is an index of at most max */
+static bool lstring_index(struct lval *args, int i, size_t max)
+{
+	return args->cell[i]->type == LVAL_LONG &&
+		args->cell[i]->val.num_long >= 0 &&
+		(unsigned long)args->cell[i]->val.num_long <= max;
+}
+
+struct lval *builtin_substring(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count == 2 || args->count == 3,
+		"Function substring passed incorrect number of arguments.  "
+		"Got %d.  Expected 2 or 3.", args->count);
+	LASSERT_STR(args, 0, "substring");
+
+	struct lval *s = args->cell[0];
+	size_t len = s->val.str.len;
+	LASSERT(args, lstring_index(args, 1, len),
+		"Function substring passed a bad start index for a length "
+		"of %zu.", len);
+	size_t start = args->cell[1]->val.num_long;
+	size_t end = len;
+	if (args->count == 3) {
+		LASSERT(args, lstring_index(args, 2, len) &&
+			(size_t)args->cell[2]->val.num_long >= start,
+			"Function substring passed a bad end index for a "
+			"length of %zu.", len);
+		end = args->cell[2]->val.num_long;
+	}
+
+	/* The substring shares the whole string's buffer */
+	lstr_retain(s->val.str.buf);
+	struct lval *result = lval_str_view(s->type, s->val.str.buf,
+		s->val.str.off + start, end - start);
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_concat(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count > 0,
+		"Function concat passed incorrect number of arguments.  "
+		"Got 0.  Expected at least 1.");
+	LASSERT_STR(args, 0, "concat");
+
+	int type = args->cell[0]->type;
+	size_t total = 0;
+	for (int i = 0; i < args->count; i++) {
+		LASSERT(args, args->cell[i]->type == type,
+			"Function concat passed incorrect type.  Got %s.  "
+			"Expected %s.", ltype(args->cell[i]->type),
+			ltype(type));
+		total += args->cell[i]->val.str.len;
+	}
+
+	/* Make room for everything at once, then append in place */
+	struct lval *result = lval_pop(args, 0);
+	lval_str_reserve(result, total - result->val.str.len);
+	for (int i = 0; i < args->count; i++)
+		lval_str_append(result, LVAL_STR(args->cell[i]),
+			args->cell[i]->val.str.len);
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_to_bytes(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "to-bytes");
+	LASSERT_STR(args, 0, "to-bytes");
+	struct lval *result = lval_take(args, 0);
+	result->type = LVAL_BYTES;
+	return result;
+}
+
+struct lval *builtin_byte_at(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "byte-at");
+	LASSERT_STR(args, 0, "byte-at");
+	size_t len = args->cell[0]->val.str.len;
+	LASSERT(args, lstring_index(args, 1, len) &&
+		(size_t)args->cell[1]->val.num_long < len,
+		"Function byte-at passed a bad index for a length of %zu.",
+		len);
+
+	unsigned char c = LVAL_STR(args->cell[0])[args->cell[1]->val.num_long];
+	lval_del(args);
+	return lval_long(c);
+}
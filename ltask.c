@@ -0,0 +1,374 @@
+/* ucontext and anonymous mappings are neither C99 nor POSIX any more */
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+/*
+ * Tasks are green threads.  Each one is a function call that runs on the
+ * thread that spawned it until it yields, when the next task in the
+ * thread's run queue gets a turn.  Nothing is preempted, so tasks share
+ * their thread's global environment without any locking.
+ *
+ * The evaluator recurses on the C stack, so every task needs a stack of its
+ * own while it runs.  Rather than give each one a stack, every task on a
+ * thread runs on the same big one, and a task that yields has the part of
+ * it that's in use, usually a few hundred bytes, copied out to the heap
+ * until it's resumed.  A suspended task costs no more than that and its
+ * bindings, so a hundred thousand of them fit easily, while a running task
+ * can still recurse as deeply as the main thread.
+ *
+ * A task waiting for I/O or a timer is parked with the event loop rather
+ * than kept on the run queue, and the loop is polled whenever the scheduler
+ * runs, so it's put back once it's ready.
+ */
+
+#define LTASK_STACK (8 * 1024 * 1024)
+/* Room below a yielding frame for the call that switches away from it */
+#define LTASK_SLACK 256
+
+enum {
+	LTASK_NEW,
+	LTASK_READY,
+	/* Waiting for the event loop to wake it, off the run queue */
+	LTASK_PARKED,
+	LTASK_DONE,
+};
+
+struct ltask {
+	int refs;
+	int state;
+	ucontext_t ctx;
+	/* The bottom of the stack it was using, and a copy while it waits */
+	char *low;
+	char *saved;
+	size_t cap;
+	/* The function and arguments to call, until it's started */
+	struct lenv *env;
+	struct lval *f;
+	struct lval *args;
+	struct lval *result;
+	/* The quota it evaluates under, which it was spawned with */
+	struct lquota *quota;
+	/* The task after this one in the run queue */
+	struct ltask *next;
+};
+
+/* Every thread has its own run queue and stack for tasks */
+static __thread struct ltask *ltask_head;
+static __thread struct ltask *ltask_tail;
+static __thread struct ltask *ltask_current;
+static __thread ucontext_t ltask_sched;
+static __thread char *ltask_stack;
+/* Set while other threads point into the running task's stack */
+static __thread int ltask_pinned;
+
+void ltask_retain(struct ltask *t)
+{
+	LREF_RETAIN(t->refs);
+}
+
+void ltask_release(struct ltask *t)
+{
+	if (LREF_RELEASE(t->refs) > 0)
+		return;
+	free(t->saved);
+	if (t->env != NULL)
+		lenv_del(t->env);
+	if (t->f != NULL)
+		lval_del(t->f);
+	if (t->args != NULL)
+		lval_del(t->args);
+	if (t->result != NULL)
+		lval_del(t->result);
+	lquota_release(t->quota);
+	free(t);
+}
+
+static void ltask_push(struct ltask *t)
+{
+	t->next = NULL;
+	if (ltask_tail != NULL)
+		ltask_tail->next = t;
+	else
+		ltask_head = t;
+	ltask_tail = t;
+}
+
+static struct ltask *ltask_pop(void)
+{
+	struct ltask *t = ltask_head;
+	ltask_head = t->next;
+	if (ltask_head == NULL)
+		ltask_tail = NULL;
+	return t;
+}
+
+static void ltask_entry(void)
+{
+	struct ltask *t = ltask_current;
+	t->result = lval_call(t->env, t->f, t->args);
+	t->args = NULL;
+	lval_del(t->f);
+	t->f = NULL;
+	lenv_del(t->env);
+	t->env = NULL;
+	__atomic_store_n(&t->state, LTASK_DONE, __ATOMIC_RELEASE);
+	setcontext(&ltask_sched);
+}
+
+/* Switch from the running task back to the scheduler */
+static void ltask_suspend(struct ltask *t)
+{
+	/* Everything this frame and its callers need is above here */
+	char here;
+	t->low = (char *)((uintptr_t)&here - LTASK_SLACK);
+	if (t->low < ltask_stack)
+		t->low = ltask_stack;
+	swapcontext(&t->ctx, &ltask_sched);
+}
+
+/* Map the thread's stack for tasks, with a guard page at the bottom */
+static bool ltask_map_stack(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	char *map = mmap(NULL, LTASK_STACK + page, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED) {
+		log_err("Could not map a stack for tasks");
+		return false;
+	}
+	mprotect(map, page, PROT_NONE);
+	ltask_stack = map + page;
+	return true;
+}
+
+/*
+ * Run a task until it yields or finishes, taking the run queue's reference
+ * to it and putting it back on the end if it isn't done.
+ */
+static void ltask_resume(struct ltask *t)
+{
+	char *top = ltask_stack + LTASK_STACK;
+
+	if (t->state == LTASK_NEW) {
+		getcontext(&t->ctx);
+		t->ctx.uc_stack.ss_sp = ltask_stack;
+		t->ctx.uc_stack.ss_size = LTASK_STACK;
+		t->ctx.uc_link = NULL;
+		makecontext(&t->ctx, ltask_entry, 0);
+		t->state = LTASK_READY;
+	} else {
+		memcpy(t->low, t->saved, top - t->low);
+	}
+
+	ltask_current = t;
+	struct lquota *quota = lquota_swap(t->quota);
+	swapcontext(&ltask_sched, &t->ctx);
+	t->quota = lquota_swap(quota);
+	ltask_current = NULL;
+
+	if (t->state == LTASK_DONE) {
+		free(t->saved);
+		t->saved = NULL;
+		ltask_release(t);
+		return;
+	}
+	size_t n = top - t->low;
+	if (n > t->cap) {
+		t->cap = n;
+		t->saved = realloc(t->saved, n);
+	}
+	memcpy(t->saved, t->low, n);
+	/* A parked task's reference goes to whatever will wake it */
+	if (t->state != LTASK_PARKED)
+		ltask_push(t);
+}
+
+/*
+ * Give every task that's waiting a turn, but not ones that are spawned or
+ * yield during this round.  Returns false if there weren't any.
+ */
+static bool ltask_round(void)
+{
+	if (ltask_head == NULL)
+		return false;
+	if (ltask_stack == NULL && !ltask_map_stack())
+		return false;
+	struct ltask *last = ltask_tail;
+	struct ltask *t;
+	do {
+		t = ltask_pop();
+		ltask_resume(t);
+	} while (t != last);
+	return true;
+}
+
+bool ltask_yield(void)
+{
+	if (ltask_current == NULL) {
+		/* Tasks whose I/O is ready get a turn too */
+		levent_poll(0);
+		return ltask_round();
+	}
+	if (ltask_pinned > 0)
+		return false;
+	ltask_suspend(ltask_current);
+	return true;
+}
+
+bool ltask_idle(int timeout)
+{
+	if (ltask_current == NULL) {
+		/* With nothing to run, free dropped lists until there is */
+		bool freeing = ltask_head == NULL && lfree_step();
+		levent_poll(ltask_head != NULL || freeing ? 0 : timeout);
+		return ltask_round() || levent_busy() || freeing;
+	}
+	if (ltask_pinned > 0) {
+		/* Nothing else can run, but waiting tasks can still be woken */
+		if (!levent_busy())
+			return false;
+		levent_poll(timeout);
+		return true;
+	}
+	ltask_suspend(ltask_current);
+	return true;
+}
+
+void ltask_drain(void)
+{
+	if (ltask_current != NULL)
+		return;
+	while (ltask_idle(-1))
+		;
+}
+
+bool ltask_inside(void)
+{
+	return ltask_current != NULL;
+}
+
+struct ltask *ltask_self(void)
+{
+	return ltask_pinned > 0 ? NULL : ltask_current;
+}
+
+void ltask_park(void)
+{
+	ltask_current->state = LTASK_PARKED;
+	ltask_suspend(ltask_current);
+}
+
+void ltask_wake(struct ltask *t)
+{
+	t->state = LTASK_READY;
+	ltask_push(t);
+}
+
+void ltask_pin(void)
+{
+	ltask_pinned++;
+}
+
+void ltask_unpin(void)
+{
+	ltask_pinned--;
+}
+
+struct ltask *ltask_spawn(struct lenv *env, struct lval *f,
+	struct lval *args)
+{
+	/* One reference for the caller, and one for the run queue */
+	struct ltask *t = malloc(sizeof(struct ltask));
+	t->refs = 2;
+	t->state = LTASK_NEW;
+	t->low = NULL;
+	t->saved = NULL;
+	t->cap = 0;
+	t->result = NULL;
+	t->quota = lquota_get();
+	lquota_retain(t->quota);
+
+	/*
+	 * The task outlives the call that spawned it, so it gets copies of
+	 * the local bindings that the function and arguments could look up.
+	 * It shares the thread's globals with every other task, unless it was
+	 * spawned where set doesn't reach them, like in a future, and then it
+	 * gets copies of those too.
+	 */
+	struct lenv *root = env;
+	bool isolated = root->isolated;
+	while (root->parent != NULL) {
+		root = root->parent;
+		isolated = isolated || root->isolated;
+	}
+	struct lenv *stop = isolated ? NULL : root;
+	t->env = lenv_new();
+	t->env->isolated = isolated;
+	if (!isolated)
+		t->env->parent = root;
+	lenv_capture(t->env, env, stop, f);
+	lenv_capture(t->env, env, stop, args);
+
+	t->f = f;
+	t->args = args;
+	ltask_push(t);
+	return t;
+}
+
+struct lval *builtin_spawn(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count > 0,
+		"Function spawn passed incorrect number of arguments.  "
+		"Got 0.  Expected at least 1.");
+	LASSERT(args, args->cell[0]->type == LVAL_FUNC,
+		"Function spawn passed incorrect type.  Got %s.  "
+		"Expected %s.", ltype(args->cell[0]->type),
+		ltype(LVAL_FUNC));
+
+	/* The rest of the arguments are passed to the function */
+	struct lval *f = lval_pop(args, 0);
+	return lval_task(ltask_spawn(env, f, args));
+}
+
+struct lval *builtin_yield(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 0, "yield");
+	ltask_yield();
+	lval_del(args);
+	return lval_sexpr();
+}
+
+struct lval *builtin_wait(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 1, "wait");
+	LASSERT(args, args->cell[0]->type == LVAL_TASK,
+		"Function wait passed incorrect type.  Got %s.  "
+		"Expected %s.", ltype(args->cell[0]->type),
+		ltype(LVAL_TASK));
+
+	struct ltask *t = args->cell[0]->val.task;
+	LASSERT(args, t != ltask_current, "A task can't wait for itself.");
+	while (__atomic_load_n(&t->state, __ATOMIC_ACQUIRE) != LTASK_DONE) {
+		/* The task belongs to another thread, or pmap is running */
+		LASSERT(args, ltask_idle(-1), "Function wait passed a task "
+			"that can't run while this thread waits for it.");
+	}
+
+	/* Every wait gets its own copy of the result */
+	struct lval *result = lval_copy(t->result);
+	lval_del(args);
+	return result;
+}
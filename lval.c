@@ -24,6 +24,24 @@ char *ltype(int type)
 		return "Function";
 	case LVAL_BOOL:
 		return "Boolean";
+	case LVAL_PORT:
+		return "Port";
+	case LVAL_STRING:
+		return "String";
+	case LVAL_BYTES:
+		return "Bytes";
+	case LVAL_HASHMAP:
+		return "Hashmap";
+	case LVAL_VECTOR:
+		return "Vector";
+	case LVAL_ISOLATE:
+		return "Isolate";
+	case LVAL_FUTURE:
+		return "Future";
+	case LVAL_CHANNEL:
+		return "Channel";
+	case LVAL_TASK:
+		return "Task";
 	default: {
 		char *err = malloc(32);
 		sprintf(err, "Unknown (%d)", type);
@@ -35,15 +53,22 @@ struct lenv *lenv_new(void)
 {
 	struct lenv *env = malloc(sizeof(struct lenv));
 	env->parent = NULL;
+	env->isolated = false;
 	env->count = 0;
 	env->syms = NULL;
 	env->vals = NULL;
 	return env;
 }
 
+struct lval *lval_alloc(void)
+{
+	lquota_alloc(sizeof(struct lval));
+	return malloc(sizeof(struct lval));
+}
+
 struct lval *lval_long(long x)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_LONG;
 	v->val.num_long = x;
 	return v;
@@ -51,7 +76,7 @@ struct lval *lval_long(long x)
 
 struct lval *lval_double(double x)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_DOUBLE;
 	v->val.num_double = x;
 	return v;
@@ -59,7 +84,7 @@ struct lval *lval_double(double x)
 
 struct lval *lval_err(char *fmt, ...)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_ERR;
 
 	/* Create a va list and initialize it */
@@ -80,7 +105,7 @@ struct lval *lval_err(char *fmt, ...)
 
 struct lval *lval_sym(char *s)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_SYM;
 	v->val.sym = malloc(strlen(s) + 1);
 	strcpy(v->val.sym, s);
@@ -89,7 +114,7 @@ struct lval *lval_sym(char *s)
 
 struct lval *lval_sexpr(void)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_SEXPR;
 	v->count = 0;
 	v->cell = NULL;
@@ -98,7 +123,7 @@ struct lval *lval_sexpr(void)
 
 struct lval *lval_func(struct lval *(*builtin)(struct lenv *env, struct lval *v))
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_FUNC;
 	v->val.func.builtin = builtin;
 	return v;
@@ -110,7 +135,7 @@ struct lval *lval_func(struct lval *(*builtin)(struct lenv *env, struct lval *v)
  */
 struct lval *lval_lambda(struct lval* formals, struct lval* body)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_FUNC;
 	/* For user defined functions, set builtin to NULL */
 	v->val.func.builtin = NULL;
@@ -122,15 +147,73 @@ struct lval *lval_lambda(struct lval* formals, struct lval* body)
 
 struct lval *lval_bool(bool b)
 {
-	struct lval *v = malloc(sizeof(struct lval));
+	struct lval *v = lval_alloc();
 	v->type = LVAL_BOOL;
 	v->val.b = b;
 	return v;
 }
 
+struct lval *lval_port(struct lport *p)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_PORT;
+	v->val.port = p;
+	return v;
+}
+
+struct lval *lval_hashmap(struct lhash *h)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_HASHMAP;
+	v->val.hash = h;
+	return v;
+}
+
+struct lval *lval_vector(struct lvec *vec, size_t start)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_VECTOR;
+	v->val.vec.vec = vec;
+	v->val.vec.start = start;
+	return v;
+}
+
+struct lval *lval_isolate(struct lisolate *iso)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_ISOLATE;
+	v->val.iso = iso;
+	return v;
+}
+
+struct lval *lval_future(struct lfuture *f)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_FUTURE;
+	v->val.future = f;
+	return v;
+}
+
+struct lval *lval_channel(struct lchan *ch)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_CHANNEL;
+	v->val.chan = ch;
+	return v;
+}
+
+struct lval *lval_task(struct ltask *t)
+{
+	struct lval *v = lval_alloc();
+	v->type = LVAL_TASK;
+	v->val.task = t;
+	return v;
+}
+
 struct lval *lval_append(struct lval *head, struct lval *tail)
 {
 	head->count++;
+	lquota_alloc(sizeof(struct lval*));
 	head->cell = realloc(head->cell, sizeof(struct lval*) * head->count);
 	head->cell[head->count - 1] = tail;
 	return head;
@@ -179,7 +262,7 @@ struct lval *lval_take(struct lval *sexpr, int i)
 
 struct lval *lval_copy(struct lval *v)
 {
-	struct lval *x = malloc(sizeof(struct lval));
+	struct lval *x = lval_alloc();
 	x->type = v->type;
 
 	switch (v->type) {
@@ -204,7 +287,14 @@ struct lval *lval_copy(struct lval *v)
 	/* Copy lists by recursively copying sub expressions */
 	case LVAL_SEXPR:
 		x->count = v->count;
+		lquota_alloc(sizeof(struct lval *) * v->count);
 		x->cell = malloc(sizeof(struct lval *) * v->count);
+		if (v->count >= LFREE_MIN)
+			lfree_pace(v->count);
+		if (LPOOL_MIN > 0 && v->count >= LPOOL_MIN) {
+			lpool_copy(x->cell, v->cell, v->count);
+			break;
+		}
 		for (int i = 0; i < x->count; i++) {
 			x->cell[i] = lval_copy(v->cell[i]);
 		}
@@ -224,6 +314,49 @@ struct lval *lval_copy(struct lval *v)
 	case LVAL_BOOL:
 		x->val.b = v->val.b;
 		break;
+
+	/* Ports are shared, not copied */
+	case LVAL_PORT:
+		x->val.port = v->val.port;
+		lport_retain(x->val.port);
+		break;
+
+	/* Strings and bytes share their buffer, since it never changes */
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		x->val.str = v->val.str;
+		lstr_retain(x->val.str.buf);
+		break;
+
+	/* Hash maps are shared, like ports */
+	case LVAL_HASHMAP:
+		x->val.hash = v->val.hash;
+		lhash_retain(x->val.hash);
+		break;
+
+	/* Vectors never change, so they're shared too */
+	case LVAL_VECTOR:
+		x->val.vec = v->val.vec;
+		lvec_retain(x->val.vec.vec);
+		break;
+
+	/* Isolates are handles on a thread, and shared like ports */
+	case LVAL_ISOLATE:
+		x->val.iso = v->val.iso;
+		lisolate_retain(x->val.iso);
+		break;
+	case LVAL_FUTURE:
+		x->val.future = v->val.future;
+		lfuture_retain(x->val.future);
+		break;
+	case LVAL_CHANNEL:
+		x->val.chan = v->val.chan;
+		lchan_retain(x->val.chan);
+		break;
+	case LVAL_TASK:
+		x->val.task = v->val.task;
+		ltask_retain(x->val.task);
+		break;
 	default:
 		lval_del(x);
 		/* There's a bug if this ever doesn't print Unknown. */
@@ -277,8 +410,8 @@ void lenv_let(struct lenv *env, struct lval *k, struct lval *v)
 
 void lenv_set(struct lenv *env, struct lval *k, struct lval *v)
 {
-	/* Iterate til we reach the global environment */
-	while (env->parent)
+	/* Iterate til we reach the global (or an isolated) environment */
+	while (env->parent && !env->isolated)
 		env = env->parent;
 	/* Set the key to the value in the global environment */
 	lenv_let(env, k, v);
@@ -288,6 +421,7 @@ struct lenv *lenv_copy(struct lenv *original)
 {
 	struct lenv *copy = malloc(sizeof(struct lenv));
 	copy->parent = original->parent;
+	copy->isolated = original->isolated;
 	copy->count = original->count;
 	copy->syms = malloc(sizeof(char*) * copy->count);
 	copy->vals = malloc(sizeof(struct lval*) * copy->count);
@@ -299,6 +433,153 @@ struct lenv *lenv_copy(struct lenv *original)
 	return copy;
 }
 
+void lenv_flatten(struct lenv *dst, struct lenv *env, struct lenv *stop)
+{
+	/* Inner environments come first, so the bindings they hide are skipped */
+	for (; env != stop; env = env->parent) {
+		for (int i = 0; i < env->count; i++) {
+			bool bound = false;
+			for (int j = 0; j < dst->count && !bound; j++)
+				bound = strcmp(dst->syms[j], env->syms[i]) == 0;
+			if (bound)
+				continue;
+			struct lval *k = lval_sym(env->syms[i]);
+			lenv_let(dst, k, env->vals[i]);
+			lval_del(k);
+		}
+	}
+}
+
+/* Where a name is bound, looking from env up to but not including stop */
+static struct lval *lenv_find(struct lenv *env, struct lenv *stop,
+	const char *sym)
+{
+	for (; env != stop; env = env->parent) {
+		for (int i = 0; i < env->count; i++) {
+			if (strcmp(env->syms[i], sym) == 0)
+				return env->vals[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Builtins that can reach bindings by names that don't appear in the code
+ * that calls them, so capturing code that mentions one captures everything
+ */
+static bool lenv_capture_all(const char *sym)
+{
+	return strcmp(sym, "load") == 0 || strcmp(sym, "load-binary") == 0 ||
+		strcmp(sym, "env") == 0;
+}
+
+/* Unlock the maps a capture looked through, which it held onto until now */
+static void lenv_unlock_maps(struct lhash **maps, size_t n)
+{
+	while (n > 0)
+		lhash_unlock(maps[--n]);
+	free(maps);
+}
+
+/* Lock a map until the capture's done, and return how many entries it has */
+static size_t lenv_lock_map(struct lhash ***maps, size_t *n, struct lhash *h)
+{
+	/* Only ever grows by one, so a power of two has run out of room */
+	if ((*n & (*n - 1)) == 0) {
+		size_t cap = *n ? *n * 2 : 1;
+		*maps = realloc(*maps, sizeof(struct lhash *) * cap);
+	}
+	(*maps)[(*n)++] = h;
+	lhash_lock(h);
+	return lhash_count(h);
+}
+
+void lenv_capture(struct lenv *dst, struct lenv *env, struct lenv *stop,
+	struct lval *v)
+{
+	/* Values still to look through for symbols, which aren't owned */
+	size_t count = 0;
+	size_t cap = 16;
+	struct lval **todo = malloc(sizeof(struct lval *) * cap);
+	todo[count++] = v;
+	/* Maps whose entries are in todo, locked so they aren't freed */
+	size_t nmaps = 0;
+	struct lhash **maps = NULL;
+
+	while (count > 0) {
+		v = todo[--count];
+		/* Room for everything this value can push */
+		size_t need = count + 2;
+		if (v->type == LVAL_SEXPR)
+			need = count + v->count;
+		else if (v->type == LVAL_FUNC && !v->val.func.builtin)
+			need = count + 2 + v->val.func.env->count;
+		else if (v->type == LVAL_HASHMAP)
+			need = count + 2 * lenv_lock_map(&maps, &nmaps,
+				v->val.hash);
+		else if (v->type == LVAL_VECTOR)
+			need = count + v->val.vec.vec->count;
+		if (need > cap) {
+			while (cap < need)
+				cap *= 2;
+			todo = realloc(todo, sizeof(struct lval *) * cap);
+		}
+
+		switch (v->type) {
+		case LVAL_SYM: {
+			if (lenv_capture_all(v->val.sym)) {
+				free(todo);
+				lenv_unlock_maps(maps, nmaps);
+				lenv_flatten(dst, env, stop);
+				return;
+			}
+			bool bound = false;
+			for (int j = 0; j < dst->count && !bound; j++)
+				bound = strcmp(dst->syms[j], v->val.sym) == 0;
+			struct lval *x = bound ? NULL :
+				lenv_find(env, stop, v->val.sym);
+			if (x == NULL)
+				break;
+			lenv_let(dst, v, x);
+			/* Functions and code it's bound to can name more */
+			todo[count++] = x;
+			break;
+		}
+		case LVAL_SEXPR:
+			for (int i = 0; i < v->count; i++)
+				todo[count++] = v->cell[i];
+			break;
+		case LVAL_FUNC: {
+			if (v->val.func.builtin)
+				break;
+			struct lenv *bound = v->val.func.env;
+			todo[count++] = v->val.func.formals;
+			todo[count++] = v->val.func.body;
+			for (int i = 0; i < bound->count; i++)
+				todo[count++] = bound->vals[i];
+			break;
+		}
+		case LVAL_HASHMAP: {
+			size_t i = 0;
+			struct lhash_entry *e;
+			while ((e = lhash_next(v->val.hash, &i)) != NULL) {
+				todo[count++] = e->key;
+				todo[count++] = e->val;
+			}
+			break;
+		}
+		case LVAL_VECTOR: {
+			struct lvec *vec = v->val.vec.vec;
+			for (size_t i = v->val.vec.start; i < vec->count; i++)
+				todo[count++] = lvec_nth(vec, i);
+			break;
+		}
+		}
+	}
+	free(todo);
+	lenv_unlock_maps(maps, nmaps);
+}
+
 void lenv_add_builtin(struct lenv *env,
 			char *name,
 			struct lval *(*builtin)(struct lenv *env, struct lval *v))
@@ -310,12 +591,57 @@ void lenv_add_builtin(struct lenv *env,
 	lval_del(v);
 }
 
+/* Powers of ten that are exactly representable as doubles */
+const double lval_pow10[LVAL_POW10_MAX + 1] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+double lval_strtod(const char *s)
+{
+	/*
+	 * Clinger's fast path:  if the digits fit in a double's 53 bit
+	 * mantissa and there are at most 22 of them after the point, both the
+	 * mantissa and the power of ten are exact, so a single correctly
+	 * rounded division gives the correctly rounded result.  Anything else
+	 * goes to strtod.
+	 */
+	const char *p = s;
+	unsigned long long m = 0;
+	int frac = -1;
+	bool neg = false;
+
+	if (*p == '-') {
+		neg = true;
+		p++;
+	}
+	for (; *p; p++) {
+		if (*p == '.' && frac < 0) {
+			frac = 0;
+			continue;
+		}
+		if (*p < '0' || *p > '9' || m > (1ULL << 53) / 10)
+			return strtod(s, NULL);
+		m = m * 10 + (*p - '0');
+		if (frac >= 0)
+			frac++;
+	}
+	if (m > (1ULL << 53) || frac > LVAL_POW10_MAX)
+		return strtod(s, NULL);
+
+	double x = (double)m;
+	if (frac > 0)
+		x /= lval_pow10[frac];
+	return neg ? -x : x;
+}
+
 struct lval *lval_read_num(mpc_ast_t *ast)
 {
 	debug("Parsing a number: %s", ast->contents);
 	errno = 0;
 	if (strstr(ast->contents, ".")) {
-		double x = strtof(ast->contents, NULL);
+		double x = lval_strtod(ast->contents);
 		debug("Float parsed as %f", x);
 		return lval_double(x);
 	} else {
@@ -328,6 +654,64 @@ struct lval *lval_read_num(mpc_ast_t *ast)
 	}
 }
 
+/* The value of a hex digit, or -1 */
+static int lval_hex(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+struct lval *lval_read_str(mpc_ast_t *ast)
+{
+	/* Skip the quotes, and the result is never longer than what's left */
+	const char *s = ast->contents + 1;
+	size_t n = strlen(s) - 1;
+	struct lstr *buf = lstr_new(n + 1);
+	char *out = buf->data;
+
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] != '\\' || i + 1 == n) {
+			*out++ = s[i];
+			continue;
+		}
+		switch (s[++i]) {
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case '0':
+			*out++ = '\0';
+			break;
+		case 'x':
+			if (i + 2 < n && lval_hex(s[i + 1]) >= 0 &&
+				lval_hex(s[i + 2]) >= 0) {
+				*out++ = lval_hex(s[i + 1]) * 16 +
+					lval_hex(s[i + 2]);
+				i += 2;
+				break;
+			}
+			*out++ = 'x';
+			break;
+		default:
+			/* Including \\ and \" */
+			*out++ = s[i];
+		}
+	}
+	buf->len = out - buf->data;
+	buf->data[buf->len] = '\0';
+	return lval_str_view(LVAL_STRING, buf, 0, buf->len);
+}
+
 struct lval *lval_read(mpc_ast_t *ast)
 {
 	debug("Entering lval_read, with tag='%s' and contents='%s'",
@@ -336,6 +720,8 @@ struct lval *lval_read(mpc_ast_t *ast)
 		return lval_read_num(ast);
 	else if (strstr(ast->tag, "symbol"))
 		return lval_sym(ast->contents);
+	else if (strstr(ast->tag, "string"))
+		return lval_read_str(ast);
 
 	/* If root, ignore the first and last child (^ and $ regexes) */
 	struct lval *sexpr = NULL;
@@ -345,7 +731,8 @@ struct lval *lval_read(mpc_ast_t *ast)
 	if (strstr(ast->tag, "sexpr"))
 		sexpr = lval_sexpr();
 	else
-		sentinel("AST tag did not match any of number, symbol, root, sexpr");
+		sentinel("AST tag did not match any of number, symbol, string, "
+			"root, sexpr");
 
 	for (int i = 0; i < ast->children_num; i++) {
 		if (strcmp(ast->children[i]->contents, "(") == 0)
@@ -362,6 +749,19 @@ error:
 	return NULL;
 }
 
+struct lval *lval_read_program(mpc_ast_t *ast)
+{
+	struct lval *forms = lval_sexpr();
+
+	/* Skip the ^ and $ regexes, everything else is a form */
+	for (int i = 0; i < ast->children_num; i++) {
+		if (strcmp(ast->children[i]->tag, "regex") == 0)
+			continue;
+		forms = lval_append(forms, lval_read(ast->children[i]));
+	}
+	return forms;
+}
+
 void lenv_del(struct lenv *env)
 {
 	for (int i = 0; i < env->count; i++) {
@@ -391,6 +791,16 @@ void lval_del(struct lval *v)
 
 	/* Recursively free lvals in S-expressions */
 	case LVAL_SEXPR:
+		/*
+		 * Long lists are freed bit by bit, so the caller can go on.
+		 * They used to be freed on the pool, like copies are, but that
+		 * still held the caller up until the pool was done with them,
+		 * and held up everything else on the pool's threads too.
+		 */
+		if (v->count >= LFREE_MIN) {
+			lfree_defer(v);
+			return;
+		}
 		for (int i = 0; i < v->count; i++)
 			lval_del(v->cell[i]);
 		/* Also free the memory allocated to contain the pointers */
@@ -407,79 +817,36 @@ void lval_del(struct lval *v)
 		break;
 	case LVAL_BOOL:
 		break;
-	default:
-		/* There's a bug if this ever doesn't print Unknown. */
-		log_err("Attempted to delete an unrecognized lval type: %s.",
-			ltype(v->type));
-	}
-
-	free(v);
-}
-
-/* Forward declare lval_print */
-void lval_print(FILE *stream, struct lval *v);
-
-void lval_expr_print(FILE *stream, struct lval *v, char open, char close)
-{
-	putc(open, stream);
-	for (int i = 0; i < v->count; i++) {
-		lval_print(stream, v->cell[i]);
-		/* Don't print trailing space if last element */
-		if (i != (v->count-1))
-			putc(' ', stream);
-	}
-	putc(close, stream);
-}
-
-void lval_print(FILE *stream, struct lval *v)
-{
-	switch (v->type) {
-	case LVAL_LONG:
-		fprintf(stream, "%ld", v->val.num_long);
+	case LVAL_PORT:
+		lport_release(v->val.port);
 		break;
-	case LVAL_DOUBLE:
-		fprintf(stream, "%f", v->val.num_double);
+	case LVAL_STRING:
+	case LVAL_BYTES:
+		lstr_release(v->val.str.buf);
 		break;
-	case LVAL_ERR:
-		fprintf(stream, "Runtime Error: %s", v->val.err);
+	case LVAL_HASHMAP:
+		lhash_release(v->val.hash);
 		break;
-	case LVAL_SYM:
-		fprintf(stream, "%s", v->val.sym);
+	case LVAL_VECTOR:
+		lvec_release(v->val.vec.vec);
 		break;
-	case LVAL_SEXPR:
-		lval_expr_print(stream, v, '(', ')');
+	case LVAL_ISOLATE:
+		lisolate_release(v->val.iso);
 		break;
-	case LVAL_FUNC:
-		/*
-		 * TODO(jfriedly):  Figure out a way to make this print the
-		 * name of the function.
-		 */
-		if (v->val.func.builtin) {
-			fprintf(stream, "<builtin function at %p>",
-				v->val.func.builtin);
-		} else {
-			fprintf(stream, "(lambda ");
-			lval_print(stream, v->val.func.formals);
-			fprintf(stream, " ");
-			lval_print(stream, v->val.func.body);
-			fprintf(stream, ")");
-		}
+	case LVAL_FUTURE:
+		lfuture_release(v->val.future);
 		break;
-	case LVAL_BOOL:
-		if (v->val.b)
-			fprintf(stream, "T");
-		else
-			fprintf(stream, "F");
+	case LVAL_CHANNEL:
+		lchan_release(v->val.chan);
+		break;
+	case LVAL_TASK:
+		ltask_release(v->val.task);
 		break;
 	default:
 		/* There's a bug if this ever doesn't print Unknown. */
-		log_err("Attempted to print an unrecognized lval type %s.",
+		log_err("Attempted to delete an unrecognized lval type: %s.",
 			ltype(v->type));
 	}
-}
 
-void lval_println(FILE *stream, struct lval *v)
-{
-	lval_print(stream, v);
-	putc('\n', stream);
+	free(v);
 }
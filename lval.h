@@ -1,13 +1,34 @@
 #ifndef lval_h
 #define lval_h
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "mpc.h"
 
+/*
+ * Reference counts on shared values can be changed by pmap's threads at
+ * once, or by isolates sharing a handle, so they're always changed
+ * atomically.  Releasing gives the count that's left.
+ */
+#define LREF_RETAIN(refs) __atomic_add_fetch(&(refs), 1, __ATOMIC_RELAXED)
+#define LREF_RELEASE(refs) __atomic_sub_fetch(&(refs), 1, __ATOMIC_ACQ_REL)
+
 /* Forward declare the Lisp environment and lvals */
 struct lenv;
 struct lval;
+struct lport;
+struct lstr;
+struct lhash;
+struct lvec;
+struct lisolate;
+struct lfuture;
+struct lchan;
+struct ltask;
+struct lquota;
 
 /*
  * A Lisp function.
@@ -39,6 +60,23 @@ struct lval {
                 char *sym;
                 struct function func;
                 bool b;
+                struct lport *port;
+                /* Strings and bytes are views of len bytes at off in buf */
+                struct {
+                        struct lstr *buf;
+                        size_t off;
+                        size_t len;
+                } str;
+                struct lhash *hash;
+                /* Vectors are the elements of vec from start on */
+                struct {
+                        struct lvec *vec;
+                        size_t start;
+                } vec;
+                struct lisolate *iso;
+                struct lfuture *future;
+                struct lchan *chan;
+                struct ltask *task;
         } val ;
         int count;
         struct lval **cell;
@@ -53,6 +91,15 @@ enum {
         LVAL_SEXPR,
         LVAL_FUNC,
         LVAL_BOOL,
+        LVAL_PORT,
+        LVAL_STRING,
+        LVAL_BYTES,
+        LVAL_HASHMAP,
+        LVAL_VECTOR,
+        LVAL_ISOLATE,
+        LVAL_FUTURE,
+        LVAL_CHANNEL,
+        LVAL_TASK,
 };
 
 char *ltype(int type);
@@ -60,6 +107,8 @@ char *ltype(int type);
 /* Lisp environment, a key-value store of strings : lvals */
 struct lenv {
         struct lenv *parent;
+        /* set binds here instead of in the global environment */
+        bool isolated;
         int count;
         char **syms;
         struct lval **vals;
@@ -68,6 +117,9 @@ struct lenv {
 /* lenv constructor */
 struct lenv *lenv_new(void);
 
+/* Allocate an lval to construct, counted against the evaluation quota */
+struct lval *lval_alloc(void);
+
 /* lval constructors */
 struct lval *lval_long(long x);
 struct lval *lval_double(double x);
@@ -77,6 +129,20 @@ struct lval *lval_sexpr(void);
 struct lval *lval_func(struct lval *(*builtin)(struct lenv *env, struct lval *v));
 struct lval *lval_lambda(struct lval* formals, struct lval* body);
 struct lval *lval_bool(bool b);
+/* Wrap a port, taking over the caller's reference to it */
+struct lval *lval_port(struct lport *p);
+/* Wrap a hash map, taking over the caller's reference to it */
+struct lval *lval_hashmap(struct lhash *h);
+/* Wrap a vector, taking over the caller's reference to it */
+struct lval *lval_vector(struct lvec *vec, size_t start);
+/* Wrap an isolate, taking over the caller's reference to it */
+struct lval *lval_isolate(struct lisolate *iso);
+/* Wrap a future, taking over the caller's reference to it */
+struct lval *lval_future(struct lfuture *f);
+/* Wrap a channel, taking over the caller's reference to it */
+struct lval *lval_channel(struct lchan *ch);
+/* Wrap a task, taking over the caller's reference to it */
+struct lval *lval_task(struct ltask *t);
 
 /* lenv and lval lval destructors */
 void lenv_del(struct lenv *env);
@@ -115,23 +181,635 @@ struct lval *lval_copy(struct lval *v);
 struct lval *lenv_get(struct lenv *env, struct lval *k);
 /* Bind a symbol to a value in a local scope. */
 void lenv_let(struct lenv *env, struct lval *k, struct lval *v);
-/* Bind a symbol to a value in a global scope. */
+/*
+ * Bind a symbol to a value in a global scope, which is the nearest isolated
+ * environment if there is one.
+ */
 void lenv_set(struct lenv *env, struct lval *k, struct lval *v);
 /* Create a copy of an environment and return it. */
 struct lenv *lenv_copy(struct lenv *original);
+/*
+ * Copy every binding visible from env into dst, inner ones hiding outer
+ * ones, stopping before stop (which may be NULL to copy them all).  Names
+ * already bound in dst keep their values.
+ */
+void lenv_flatten(struct lenv *dst, struct lenv *env, struct lenv *stop);
+/*
+ * Like lenv_flatten, but only copy the bindings v could look up:  those
+ * named anywhere in it, or in anything they're bound to, and so on.  If any
+ * of that names load, load-binary or env, which can look up names that
+ * aren't written down, everything is copied after all.
+ */
+void lenv_capture(struct lenv *dst, struct lenv *env, struct lenv *stop,
+	struct lval *v);
 
 /* Add builtin functions to the environement */
 void lenv_add_builtin(struct lenv *env,
                         char *name,
                         struct lval *(*builtin)(struct lenv *env, struct lval *v));
+/* Add every builtin to a new global environment (defined in mylisp.c) */
+void lenv_add_builtins(struct lenv *env);
 
 /* Functions for reading lvals from an AST */
 struct lval *lval_read_num(mpc_ast_t *ast);
+/*
+ * Convert the decimal text of a number into the nearest double.  Typical
+ * numbers are converted exactly without calling strtod.
+ */
+double lval_strtod(const char *s);
+
+/* lval_pow10[i] is 10^i, for every power of ten a double holds exactly */
+#define LVAL_POW10_MAX 22
+extern const double lval_pow10[LVAL_POW10_MAX + 1];
+/* Read a string literal, with its quotes and escapes */
+struct lval *lval_read_str(mpc_ast_t *ast);
 struct lval *lval_read(mpc_ast_t *ast);
+/* Read the AST of a whole program into an S-expression of its forms */
+struct lval *lval_read_program(mpc_ast_t *ast);
+
+/****************************************************************************
+ * Functions below here are defined in lprint.c
+ ***************************************************************************/
+
+#define LBUF_SIZE 4096
+
+/*
+ * An output buffer that lvals are printed into.
+ *
+ * A FILE buffer fills the fixed array and writes it out to the stream
+ * whenever it fills up, so printing doesn't allocate.  A string buffer (with
+ * no stream) starts in the fixed array and moves to the heap if it outgrows
+ * it.
+ */
+struct lbuf {
+	FILE *stream;
+	char *data;
+	size_t len;
+	size_t cap;
+	char fixed[LBUF_SIZE];
+};
+
+/* Set up a buffer that writes to a stream, or one that builds a string */
+void lbuf_file(struct lbuf *b, FILE *stream);
+void lbuf_string(struct lbuf *b);
+/* Write out anything buffered for a stream */
+void lbuf_flush(struct lbuf *b);
+/* Return the NUL terminated contents of a string buffer.  Free the result */
+char *lbuf_take(struct lbuf *b);
+
+/* Append raw text and formatted numbers */
+void lbuf_write(struct lbuf *b, const char *s, size_t n);
+void lbuf_putc(struct lbuf *b, char c);
+void lbuf_puts(struct lbuf *b, const char *s);
+void lbuf_long(struct lbuf *b, long x);
+void lbuf_double(struct lbuf *b, double x);
+
+/* Append the printed form of an lval */
+void lbuf_expr(struct lbuf *b, struct lval *v, char open, char close);
+void lbuf_lval(struct lbuf *b, struct lval *v);
 
 /* Functions for printing lvals */
 void lval_expr_print(FILE *stream, struct lval *v, char open, char close);
 void lval_print(FILE *stream, struct lval *v);
 void lval_println(FILE *stream, struct lval *v);
+/* Return the printed form of an lval as a new string.  Free the result */
+char *lval_to_string(struct lval *v);
+
+/****************************************************************************
+ * Functions below here are defined in lserial.c
+ ***************************************************************************/
+
+/* Bump this whenever the binary format changes */
+#define LSERIAL_VERSION 4
+
+/* Append the magic number and version that start a binary file */
+void lserial_header(struct lbuf *b);
+/*
+ * Append the binary encoding of an lval to a string lbuf.  The environment is
+ * used to look up the names of builtins.  Returns false if the value can't
+ * be encoded, such as a builtin that isn't bound to any global name.
+ */
+bool lserial_write(struct lbuf *b, struct lenv *env, struct lval *v);
+/*
+ * Append every binding in env, for saving the global environment.  Any
+ * that can't be encoded, such as ports, are left out with a warning naming
+ * them on stderr.
+ */
+void lserial_write_env(struct lbuf *b, struct lenv *env);
+/*
+ * Decode a binary file (header included) that has been read or mapped into
+ * memory.  The data is read in place, and an error lval is returned if it's
+ * malformed.
+ */
+struct lval *lserial_decode(struct lenv *env, const char *data, size_t len);
+/*
+ * Decode an image written by save-image and bind everything in it into env,
+ * which should already have its builtins.  Returns an empty S-expression, or
+ * an error lval if the image is malformed.
+ */
+struct lval *lserial_decode_env(struct lenv *env, const char *data,
+	size_t len);
+/* Map an image file and decode it into env as above */
+struct lval *lserial_load_image(struct lenv *env, char *path);
+
+/* Map a file read only.  Returns NULL and sets errno on failure */
+const char *lserial_map(char *path, size_t *len);
+void lserial_unmap(const char *data, size_t len);
+
+/* Return the file path held by an lval, or NULL if it isn't one */
+char *lval_path(struct lval *v);
+
+/****************************************************************************
+ * Functions below here are defined in lport.c
+ ***************************************************************************/
+
+/* Size of the buffer behind each port, grown for lines longer than this */
+#define LPORT_SIZE (1 << 20)
+/* Pipes and sockets can be far more numerous, so they start smaller */
+#define LPORT_STREAM_SIZE (1 << 16)
+
+/*
+ * A port is an open file with its own buffer.  Reads and writes go through
+ * the buffer and only reach the file a buffer at a time.  Ports are shared
+ * rather than copied by lval_copy, and closed when the last lval holding one
+ * is deleted, if they haven't been closed already.
+ *
+ * Ports on pipes and sockets are non-blocking, and wait on the event loop
+ * when they can't be read or written yet.  A socket has two ports, one for
+ * each direction, so each has a buffer to itself.
+ */
+struct lport {
+	int fd;
+	int refs;
+	bool readable;
+	bool writable;
+	bool eof;
+	/* Pipes and sockets, which park the task instead of blocking */
+	bool stream;
+	char *path;
+	/* Unread input is buf[start..end), unwritten output is buf[0..end) */
+	char *buf;
+	size_t cap;
+	size_t start;
+	size_t end;
+	/* Writable ports are kept in a list to be flushed at exit */
+	struct lport *prev;
+	struct lport *next;
+};
+
+/*
+ * Open a port on a file.  The mode is "r", "w" or "a", as for fopen.
+ * Returns NULL and sets errno on failure.
+ */
+struct lport *lport_open(const char *path, const char *mode);
+/* Take or drop a reference to a port.  Dropping the last one closes it */
+void lport_retain(struct lport *p);
+void lport_release(struct lport *p);
+/* Close a port early.  Later reads see EOF and later writes fail */
+bool lport_close(struct lport *p);
+
+/*
+ * Read the next line, without its newline.  Returns a pointer into the
+ * port's buffer that's only good until the next read, or NULL at EOF.
+ */
+const char *lport_read_line(struct lport *p, size_t *len);
+/* Read up to n bytes, with the same rules as lport_read_line */
+const char *lport_read(struct lport *p, size_t n, size_t *len);
+/* Buffer n bytes for writing, and write out the buffer */
+bool lport_write(struct lport *p, const char *s, size_t n);
+bool lport_flush(struct lport *p);
+
+/*
+ * Listen on a Unix domain socket at path.  Returns NULL and sets errno on
+ * failure.
+ */
+struct lport *lport_listen(const char *path);
+/* Wait for a connection, and return its (in out) ports or an error */
+struct lval *lport_accept(struct lport *p);
+
+/****************************************************************************
+ * Functions below here are defined in lstring.c
+ ***************************************************************************/
+
+/*
+ * The buffer behind strings and bytes.
+ *
+ * The first len bytes of a buffer never change once they're written, so
+ * copying a string or taking a substring just shares the buffer, and it's
+ * freed when the last view of it is deleted.  Appending claims the unused
+ * space after them, which no view can see yet, so building a string up one
+ * piece at a time only copies it each time the buffer doubles.
+ */
+struct lstr {
+	int refs;
+	size_t len;
+	size_t cap;
+	char data[];
+};
+
+/* The first byte of a string or bytes lval */
+#define LVAL_STR(v) ((v)->val.str.buf->data + (v)->val.str.off)
+
+/* Allocate an empty buffer with room for cap bytes, the NUL included */
+struct lstr *lstr_new(size_t cap);
+/* Take or drop a reference to a buffer */
+void lstr_retain(struct lstr *s);
+void lstr_release(struct lstr *s);
+
+/* Make a string or bytes lval from a copy of n bytes */
+struct lval *lval_string(const char *s, size_t n);
+struct lval *lval_bytes(const char *s, size_t n);
+/*
+ * Make a string or bytes lval viewing len bytes at off in a buffer, taking
+ * over the caller's reference to it.
+ */
+struct lval *lval_str_view(int type, struct lstr *buf, size_t off,
+	size_t len);
+/* Append n bytes to a string or bytes lval in place and return it */
+struct lval *lval_str_append(struct lval *v, const char *s, size_t n);
+/*
+ * Return the contents of a string or bytes lval NUL terminated, copying
+ * them into a buffer of their own if the buffer is shared.
+ */
+char *lval_cstr(struct lval *v);
+
+/****************************************************************************
+ * Functions below here are defined in lhash.c
+ ***************************************************************************/
+
+/* A key and value in a hash map.  Empty slots have a NULL key */
+struct lhash_entry {
+	uint64_t hash;
+	struct lval *key;
+	struct lval *val;
+};
+
+/*
+ * An open addressed table with linear probing.  used counts the deleted
+ * slots as well as the live ones, since they both lengthen probes.
+ */
+struct lhash_table {
+	struct lhash_entry *slots;
+	size_t cap;
+	size_t live;
+	size_t used;
+};
+
+/*
+ * A hash map.
+ *
+ * When the table fills up, a bigger one is allocated and the entries are
+ * moved into it a few slots at a time by each later put and remove, rather
+ * than all at once.  Until they've all moved, lookups check the new table
+ * and then what's left of the old one, slots [moved, cap) of it.
+ *
+ * Like ports, hash maps are shared rather than copied by lval_copy, so
+ * putting into a map changes it everywhere it's bound, including in pmap
+ * calls and futures on other threads.  The lock is held by everything that
+ * reads or changes the tables.
+ */
+struct lhash {
+	int refs;
+	pthread_mutex_t lock;
+	struct lhash_table cur;
+	struct lhash_table old;
+	size_t moved;
+};
+
+/* Allocate an empty hash map */
+struct lhash *lhash_new(void);
+/* Take or drop a reference to a hash map */
+void lhash_retain(struct lhash *h);
+void lhash_release(struct lhash *h);
+/*
+ * Hold a map's lock, to read its entries with lhash_next.  It's recursive,
+ * so the functions below can still be called while it's held.
+ */
+void lhash_lock(struct lhash *h);
+void lhash_unlock(struct lhash *h);
+
+/*
+ * Hash a key.  Integers, floats, symbols, strings, bytes and booleans can be
+ * keys, and returns false for anything else.  Keys are only equal if they're
+ * the same type, so 1 and 1.0 are different keys.
+ */
+bool lhash_key(struct lval *k, uint64_t *hash);
+/* Look up a key.  Returns a copy of the value, or NULL */
+struct lval *lhash_get(struct lhash *h, struct lval *k, uint64_t hash);
+/* Whether a key is in the map */
+bool lhash_has(struct lhash *h, struct lval *k, uint64_t hash);
+/* Bind a key to a value, taking ownership of both */
+void lhash_put(struct lhash *h, struct lval *k, uint64_t hash,
+	struct lval *v);
+/* Remove a key.  Returns false if it wasn't there */
+bool lhash_remove(struct lhash *h, struct lval *k, uint64_t hash);
+/* The number of entries */
+size_t lhash_count(struct lhash *h);
+/*
+ * Iterate over the entries, in no particular order.  Start with *i set to 0,
+ * and NULL is returned after the last one.  The map's lock must be held
+ * from the first call until the entries are no longer needed.
+ */
+struct lhash_entry *lhash_next(struct lhash *h, size_t *i);
+
+/****************************************************************************
+ * Functions below here are defined in lvec.c
+ ***************************************************************************/
+
+#define LVEC_BITS 5
+#define LVEC_WIDTH (1 << LVEC_BITS)
+#define LVEC_MASK (LVEC_WIDTH - 1)
+
+/*
+ * A node of a vector's trie.  Leaves hold elements and inner nodes hold
+ * other nodes.  Nodes are shared between vectors and never change, except
+ * that len only grows:  a leaf's first len elements are set, and a vector
+ * whose elements end at len can append into the leaf without copying it,
+ * since no other vector can see past len.
+ */
+struct lvec_node {
+	int refs;
+	bool leaf;
+	int len;
+	union {
+		struct lvec_node *child[LVEC_WIDTH];
+		struct lval *val[LVEC_WIDTH];
+	} u;
+};
+
+/*
+ * A persistent vector, as a 32-way trie with the last (up to) 32 elements
+ * kept in a separate tail leaf so that appending rarely touches the trie.
+ * Elements [0, tail offset) are in the trie under root, which is shift
+ * bits deep.  A changed vector is a new lvec that shares every node but
+ * the ones on the path to the change.
+ */
+struct lvec {
+	int refs;
+	size_t count;
+	int shift;
+	struct lvec_node *root;
+	struct lvec_node *tail;
+};
+
+/* Make an empty vector */
+struct lvec *lvec_new(void);
+/* Take or drop a reference to a vector */
+void lvec_retain(struct lvec *v);
+void lvec_release(struct lvec *v);
+/* Return element i, still owned by the vector */
+struct lval *lvec_nth(struct lvec *v, size_t i);
+/* Return a new vector with x, which it takes, appended */
+struct lvec *lvec_conj(struct lvec *v, struct lval *x);
+/* Return a new vector with element i replaced by x, which it takes */
+struct lvec *lvec_assoc(struct lvec *v, size_t i, struct lval *x);
+
+/****************************************************************************
+ * Functions below here are defined in lisolate.c
+ ***************************************************************************/
+
+/*
+ * An isolate is an interpreter running a script on a thread of its own,
+ * with its own global environment.  Nothing it evaluates is shared with any
+ * other isolate:  its arguments and result are encoded in the binary format
+ * and decoded on the other side, so they're always copies.  The handle is
+ * shared by every lval holding it and by the isolate's thread, and freed
+ * when the last of them lets go.
+ */
+
+/* Take or drop a reference to an isolate */
+void lisolate_retain(struct lisolate *iso);
+void lisolate_release(struct lisolate *iso);
+/* The script an isolate is running */
+const char *lisolate_path(struct lisolate *iso);
+
+/****************************************************************************
+ * Functions below here are defined in lfuture.c
+ ***************************************************************************/
+
+/* Take or drop a reference to a future */
+void lfuture_retain(struct lfuture *f);
+void lfuture_release(struct lfuture *f);
+/*
+ * Evaluate a future's expression unless another thread already has, or is.
+ * Called by pool threads for queued futures, and by touch.
+ */
+void lfuture_run(struct lfuture *f);
+
+/****************************************************************************
+ * Functions below here are defined in lchan.c
+ ***************************************************************************/
+
+/* Make a channel with room for at least cap values */
+struct lchan *lchan_new(size_t cap);
+/* Take or drop a reference to a channel */
+void lchan_retain(struct lchan *ch);
+void lchan_release(struct lchan *ch);
+/*
+ * Send a value, taking it and waiting while the channel is full.  Returns
+ * false if the channel is closed or the quota's deadline passes, and the
+ * value is still the caller's.
+ */
+bool lchan_send(struct lchan *ch, struct lval *v);
+/*
+ * Receive a value, waiting while the channel is empty if block is set.
+ * Returns NULL once the channel is closed and empty, if it's empty and
+ * block isn't set, or if the quota's deadline passes.
+ */
+struct lval *lchan_recv(struct lchan *ch, bool block);
+/* Close a channel.  Values already sent can still be received */
+void lchan_close(struct lchan *ch);
+
+/****************************************************************************
+ * Functions below here are defined in ltask.c
+ ***************************************************************************/
+
+/* Take or drop a reference to a task */
+void ltask_retain(struct ltask *t);
+void ltask_release(struct ltask *t);
+/*
+ * Let this thread's other tasks run.  In a task, it's suspended until its
+ * next turn;  anywhere else, every waiting task gets a turn.  Returns false
+ * if there was nothing to switch to, so the caller should sleep instead.
+ */
+bool ltask_yield(void);
+/*
+ * Like ltask_yield, but when no task is ready to run, wait up to timeout
+ * milliseconds (or forever if it's negative) for the event loop to wake
+ * one.  Returns false if nothing on this thread could ever run.
+ */
+bool ltask_idle(int timeout);
+/* Run this thread's tasks until they've all finished, unless in a task */
+void ltask_drain(void);
+/*
+ * Start a task that calls f with args, taking both, in an environment like
+ * the one spawn gives it.  Returns the caller's reference to the task.
+ */
+struct ltask *ltask_spawn(struct lenv *env, struct lval *f,
+	struct lval *args);
+/* The running task, or NULL if there isn't one that can be suspended */
+struct ltask *ltask_self(void);
+/* Whether a task is running on this thread, even one that can't be */
+bool ltask_inside(void);
+/*
+ * Suspend the running task until ltask_wake is called on it, which takes
+ * over the run queue's reference to it.
+ */
+void ltask_park(void);
+void ltask_wake(struct ltask *t);
+/*
+ * Keep the running task from being switched out, for while other threads
+ * point into its stack.  Yielding just returns false until it's unpinned.
+ */
+void ltask_pin(void);
+void ltask_unpin(void);
+
+/****************************************************************************
+ * Functions below here are defined in levent.c
+ ***************************************************************************/
+
+/*
+ * Wake the tasks whose file descriptors or timers are ready, waiting up to
+ * timeout milliseconds (or forever if it's negative) for the first one.
+ */
+void levent_poll(int timeout);
+/* Whether anything on this thread is waiting on the event loop */
+bool levent_busy(void);
+/*
+ * Wait until a file descriptor can be read from (or written to, if write is
+ * set).  The running task is parked meanwhile, and anywhere else, this
+ * thread's tasks run until it's ready.  Regular files are always ready.
+ * Returns false and sets errno if it can't be waited on, or to ETIMEDOUT if
+ * the quota's deadline passed first.
+ */
+bool levent_wait(int fd, bool write);
+/* Wake everything waiting on a file descriptor that's about to be closed */
+void levent_forget(int fd);
+/*
+ * Wait for some milliseconds, the same way as levent_wait.  Returns false if
+ * the quota's deadline cut it short.
+ */
+bool levent_sleep(long ms);
+/*
+ * Make a waiter for the running task, or for this thread outside a task,
+ * that another thread can wake with levent_signal.  Put it on a list that
+ * thread will look at, check that there's still something to wait for, then
+ * levent_await it, which waits like levent_wait does.  If the deadline
+ * passes first, levent_await takes it off the list under the list's lock,
+ * along with one from the count of waiters on it, if it's given one, and
+ * returns false.
+ */
+struct levent_waiter *levent_waiter_new(void);
+bool levent_await(struct levent_waiter *w, pthread_mutex_t *lock,
+	struct levent_waiter **list, int *count);
+void levent_waiter_free(struct levent_waiter *w);
+/* Wake a waiter from any thread.  Each one must be signalled only once. */
+void levent_signal(struct levent_waiter *w);
+/*
+ * Keep a list of waiters on whatever they're waiting for, under its lock.
+ * levent_delist returns whether the waiter was still on it, and once
+ * levent_signal_all is given a list, it's done with.
+ */
+void levent_enlist(struct levent_waiter **list, struct levent_waiter *w);
+bool levent_delist(struct levent_waiter **list, struct levent_waiter *w);
+void levent_signal_all(struct levent_waiter *list);
+/* Free the event loop of a thread that's about to exit */
+void levent_cleanup(void);
+
+/****************************************************************************
+ * Functions below here are defined in lpool.c
+ ***************************************************************************/
+
+/*
+ * Queue a future for a pool thread to run, taking a reference to it.
+ * Returns false if the queue is full or there are no pool threads, in which
+ * case the caller should run it.
+ */
+bool lpool_submit(struct lfuture *f);
+/*
+ * Copy the n elements of a list, in parallel if the pool's free.  Only done
+ * for lists at least LPOOL_MIN long, and not at all when it's 0, which it
+ * is unless the build sets it, like -DLPOOL_MIN=65536.  It hasn't been shown
+ * to be any faster yet, and bench/copy.sh measures where it starts to be.
+ */
+#ifndef LPOOL_MIN
+#define LPOOL_MIN 0
+#endif
+void lpool_copy(struct lval **dst, struct lval **src, size_t n);
+
+/****************************************************************************
+ * Functions below here are defined in lfree.c
+ ***************************************************************************/
+
+/* Lists at least this long are freed a slice at a time */
+#define LFREE_MIN 4096
+/* Slices are counted by whether they took under 1, 2, 4 ... microseconds */
+#define LFREE_BUCKETS 12
+
+/* Set a list aside to be freed later, rather than all at once */
+void lfree_defer(struct lval *v);
+/*
+ * Spend up to MYLISP_PAUSE microseconds freeing lists this thread has set
+ * aside.  Returns true if any are left.
+ */
+bool lfree_step(void);
+/* Free about as much as a list of n elements that's being copied takes */
+void lfree_pace(size_t n);
+/* Free everything this thread has set aside, before it ends */
+void lfree_drain(void);
+
+/****************************************************************************
+ * Functions below here are defined in lquota.c
+ ***************************************************************************/
+
+/*
+ * Make a quota for an evaluation, with limits on steps, bytes allocated and
+ * milliseconds from now, each of which is ignored if it's 0
+ */
+struct lquota *lquota_new(long max_steps, long max_bytes, long max_ms);
+/* Take or drop a reference to a quota, which can be NULL */
+void lquota_retain(struct lquota *q);
+void lquota_release(struct lquota *q);
+/* The quota this thread is evaluating under, or NULL */
+struct lquota *lquota_get(void);
+/*
+ * Evaluate under another quota, or none if it's NULL, taking the caller's
+ * reference to it.  Returns the one it replaces, with its reference.
+ */
+struct lquota *lquota_swap(struct lquota *q);
+/* Count a step of evaluation.  Returns false once the quota's passed */
+bool lquota_step(void);
+/*
+ * Count n bytes allocated for values, checking the limit as soon as they
+ * might pass it.  Returns false once the quota's passed.
+ */
+bool lquota_alloc(size_t n);
+/* Check the quota now, rather than when it's next due */
+bool lquota_check(void);
+/* Whether the quota had passed when it was last checked */
+bool lquota_over(void);
+/*
+ * When the quota runs out of time, in milliseconds on the monotonic clock,
+ * or 0 if it can't
+ */
+long long lquota_deadline(void);
+/* An error saying which limit the quota passed */
+struct lval *lquota_err(void);
+
+/****************************************************************************
+ * Functions below here are defined in lload.c
+ ***************************************************************************/
+
+/*
+ * Read every form in a source file into an S-expression, through the source
+ * cache.  Returns an error lval if the file can't be read or doesn't parse.
+ */
+struct lval *lload_forms(struct lenv *env, char *path);
+/*
+ * Evaluate an S-expression of forms in order, consuming it, and printing
+ * each result to out unless it's NULL.  Returns the value of the last form,
+ * or the first error, which isn't printed.
+ */
+struct lval *lload_eval(struct lenv *env, struct lval *forms, FILE *out);
 
 #endif
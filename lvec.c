@@ -0,0 +1,301 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "lval.h"
+#include "eval.h"
+
+static struct lvec_node *lvec_node_new(bool leaf)
+{
+	lquota_alloc(sizeof(struct lvec_node));
+	struct lvec_node *n = calloc(1, sizeof(struct lvec_node));
+	n->refs = 1;
+	n->leaf = leaf;
+	return n;
+}
+
+static void lvec_node_retain(struct lvec_node *n)
+{
+	LREF_RETAIN(n->refs);
+}
+
+static void lvec_node_release(struct lvec_node *n)
+{
+	if (LREF_RELEASE(n->refs) > 0)
+		return;
+	for (int i = 0; i < n->len; i++) {
+		if (n->leaf)
+			lval_del(n->u.val[i]);
+		else if (n->u.child[i] != NULL)
+			lvec_node_release(n->u.child[i]);
+	}
+	free(n);
+}
+
+/* Copy the first len slots of a node, copying elements or sharing nodes */
+static struct lvec_node *lvec_node_copy(struct lvec_node *n, int len)
+{
+	struct lvec_node *c = lvec_node_new(n->leaf);
+	c->len = len;
+	for (int i = 0; i < len; i++) {
+		if (n->leaf) {
+			c->u.val[i] = lval_copy(n->u.val[i]);
+		} else {
+			c->u.child[i] = n->u.child[i];
+			if (c->u.child[i] != NULL)
+				lvec_node_retain(c->u.child[i]);
+		}
+	}
+	return c;
+}
+
+/* Make a vector, taking over the references to root and tail */
+static struct lvec *lvec_make(size_t count, int shift, struct lvec_node *root,
+	struct lvec_node *tail)
+{
+	struct lvec *v = malloc(sizeof(struct lvec));
+	v->refs = 1;
+	v->count = count;
+	v->shift = shift;
+	v->root = root;
+	v->tail = tail;
+	return v;
+}
+
+struct lvec *lvec_new(void)
+{
+	return lvec_make(0, LVEC_BITS, lvec_node_new(false),
+		lvec_node_new(true));
+}
+
+void lvec_retain(struct lvec *v)
+{
+	LREF_RETAIN(v->refs);
+}
+
+void lvec_release(struct lvec *v)
+{
+	if (LREF_RELEASE(v->refs) > 0)
+		return;
+	lvec_node_release(v->root);
+	lvec_node_release(v->tail);
+	free(v);
+}
+
+/* The index of the first element in the tail */
+static size_t lvec_tailoff(struct lvec *v)
+{
+	if (v->count < LVEC_WIDTH)
+		return 0;
+	return ((v->count - 1) >> LVEC_BITS) << LVEC_BITS;
+}
+
+struct lval *lvec_nth(struct lvec *v, size_t i)
+{
+	if (i >= lvec_tailoff(v))
+		return v->tail->u.val[i & LVEC_MASK];
+
+	struct lvec_node *n = v->root;
+	for (int level = v->shift; level > 0; level -= LVEC_BITS)
+		n = n->u.child[(i >> level) & LVEC_MASK];
+	return n->u.val[i & LVEC_MASK];
+}
+
+/* A chain of new inner nodes down to a leaf, level bits above it */
+static struct lvec_node *lvec_path(int level, struct lvec_node *leaf)
+{
+	if (level == 0) {
+		lvec_node_retain(leaf);
+		return leaf;
+	}
+	struct lvec_node *n = lvec_node_new(false);
+	n->u.child[0] = lvec_path(level - LVEC_BITS, leaf);
+	n->len = 1;
+	return n;
+}
+
+/* Copy the path down to where v's full tail goes in the trie, and put it */
+static struct lvec_node *lvec_push_tail(struct lvec *v, int level,
+	struct lvec_node *parent)
+{
+	int sub = ((v->count - 1) >> level) & LVEC_MASK;
+	struct lvec_node *n = lvec_node_copy(parent, parent->len);
+	struct lvec_node *child = sub < n->len ? n->u.child[sub] : NULL;
+
+	if (level == LVEC_BITS) {
+		lvec_node_retain(v->tail);
+		n->u.child[sub] = v->tail;
+	} else if (child != NULL) {
+		n->u.child[sub] = lvec_push_tail(v, level - LVEC_BITS, child);
+		lvec_node_release(child);
+	} else {
+		n->u.child[sub] = lvec_path(level - LVEC_BITS, v->tail);
+	}
+	if (sub >= n->len)
+		n->len = sub + 1;
+	return n;
+}
+
+struct lvec *lvec_conj(struct lvec *v, struct lval *x)
+{
+	size_t tlen = v->count - lvec_tailoff(v);
+
+	if (tlen < LVEC_WIDTH) {
+		/*
+		 * Append in place if no other vector has appended here yet,
+		 * claiming the slot with a compare and swap in case another
+		 * thread is trying to at the same time.
+		 */
+		struct lvec_node *tail = v->tail;
+		int len = tlen;
+		if (__atomic_compare_exchange_n(&tail->len, &len, len + 1,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			lvec_node_retain(tail);
+		} else {
+			tail = lvec_node_copy(tail, tlen);
+			tail->len++;
+		}
+		tail->u.val[tlen] = x;
+		lvec_node_retain(v->root);
+		return lvec_make(v->count + 1, v->shift, v->root, tail);
+	}
+
+	/* The tail is full, so it goes into the trie and a new one starts */
+	struct lvec_node *root;
+	int shift = v->shift;
+	if ((v->count >> LVEC_BITS) > ((size_t)1 << shift)) {
+		/* The trie is full too, and gets a new level */
+		root = lvec_node_new(false);
+		lvec_node_retain(v->root);
+		root->u.child[0] = v->root;
+		root->u.child[1] = lvec_path(shift, v->tail);
+		root->len = 2;
+		shift += LVEC_BITS;
+	} else {
+		root = lvec_push_tail(v, shift, v->root);
+	}
+	struct lvec_node *tail = lvec_node_new(true);
+	tail->u.val[0] = x;
+	tail->len = 1;
+	return lvec_make(v->count + 1, shift, root, tail);
+}
+
+/* Copy the path down to element i, replacing it with x */
+static struct lvec_node *lvec_do_assoc(int level, struct lvec_node *node,
+	size_t i, struct lval *x)
+{
+	struct lvec_node *n = lvec_node_copy(node, node->len);
+	if (level == 0) {
+		lval_del(n->u.val[i & LVEC_MASK]);
+		n->u.val[i & LVEC_MASK] = x;
+	} else {
+		int sub = (i >> level) & LVEC_MASK;
+		struct lvec_node *child = n->u.child[sub];
+		n->u.child[sub] = lvec_do_assoc(level - LVEC_BITS, child, i, x);
+		lvec_node_release(child);
+	}
+	return n;
+}
+
+struct lvec *lvec_assoc(struct lvec *v, size_t i, struct lval *x)
+{
+	size_t tailoff = lvec_tailoff(v);
+	if (i >= tailoff) {
+		struct lvec_node *tail = lvec_node_copy(v->tail,
+			v->count - tailoff);
+		lval_del(tail->u.val[i - tailoff]);
+		tail->u.val[i - tailoff] = x;
+		lvec_node_retain(v->root);
+		return lvec_make(v->count, v->shift, v->root, tail);
+	}
+
+	struct lvec_node *root = lvec_do_assoc(v->shift, v->root, i, x);
+	lvec_node_retain(v->tail);
+	return lvec_make(v->count, v->shift, root, v->tail);
+}
+
+#define LASSERT_VECTOR(args, i, func_name) \
+	LASSERT(args, args->cell[i]->type == LVAL_VECTOR, \
+		"Function %s passed incorrect type.  Got %s.  " \
+		"Expected %s.", func_name, ltype(args->cell[i]->type), \
+		ltype(LVAL_VECTOR));
+
+/* True if the ith argument is an index into a vector of length n */
+static bool lvec_index(struct lval *args, int i, size_t n)
+{
+	return args->cell[i]->type == LVAL_LONG &&
+		args->cell[i]->val.num_long >= 0 &&
+		(unsigned long)args->cell[i]->val.num_long < n;
+}
+
+/* Append every argument from the first on to a vector, consuming them */
+static struct lvec *lvec_conj_args(struct lvec *v, struct lval *args,
+	int first)
+{
+	lvec_retain(v);
+	for (int i = first; i < args->count; i++) {
+		struct lvec *next = lvec_conj(v, args->cell[i]);
+		args->cell[i] = NULL;
+		lvec_release(v);
+		v = next;
+	}
+	args->count = first;
+	return v;
+}
+
+struct lval *builtin_vector(struct lenv *env, struct lval *args)
+{
+	struct lvec *empty = lvec_new();
+	struct lvec *v = lvec_conj_args(empty, args, 0);
+	lvec_release(empty);
+	lval_del(args);
+	return lval_vector(v, 0);
+}
+
+struct lval *builtin_conj(struct lenv *env, struct lval *args)
+{
+	LASSERT(args, args->count > 0,
+		"Function conj passed incorrect number of arguments.  "
+		"Got 0.  Expected at least 1.");
+	LASSERT_VECTOR(args, 0, "conj");
+
+	struct lval *x = args->cell[0];
+	struct lvec *v = lvec_conj_args(x->val.vec.vec, args, 1);
+	struct lval *result = lval_vector(v, x->val.vec.start);
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_assoc(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 3, "assoc");
+	LASSERT_VECTOR(args, 0, "assoc");
+	struct lval *x = args->cell[0];
+	size_t n = x->val.vec.vec->count - x->val.vec.start;
+	LASSERT(args, lvec_index(args, 1, n),
+		"Function assoc passed a bad index for a length of %zu.", n);
+
+	size_t i = x->val.vec.start + args->cell[1]->val.num_long;
+	struct lvec *v = lvec_assoc(x->val.vec.vec, i, lval_pop(args, 2));
+	struct lval *result = lval_vector(v, x->val.vec.start);
+	lval_del(args);
+	return result;
+}
+
+struct lval *builtin_nth(struct lenv *env, struct lval *args)
+{
+	LASSERT_ARGC(args, 2, "nth");
+	LASSERT_VECTOR(args, 0, "nth");
+	struct lval *x = args->cell[0];
+	size_t n = x->val.vec.vec->count - x->val.vec.start;
+	LASSERT(args, lvec_index(args, 1, n),
+		"Function nth passed a bad index for a length of %zu.", n);
+
+	size_t i = x->val.vec.start + args->cell[1]->val.num_long;
+	struct lval *result = lval_copy(lvec_nth(x->val.vec.vec, i));
+	lval_del(args);
+	return result;
+}
@@ -1,5 +1,16 @@
 #include "mpc.h"
 
+/*
+** Anything a parse keeps outside its stack is per
+** thread, so separate threads can parse at once.
+*/
+
+#if defined(__GNUC__)
+#define MPC_THREAD_LOCAL __thread
+#else
+#define MPC_THREAD_LOCAL
+#endif
+
 /*
 ** State Type
 */
@@ -70,6 +81,29 @@ void mpc_err_delete(mpc_err_t *x) {
   free(x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  
+  int i;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
+  
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = malloc(sizeof(char*) * x->expected_num);
+  for (i = 0; i < x->expected_num; i++) {
+    y->expected[i] = malloc(strlen(x->expected[i]) + 1);
+    strcpy(y->expected[i], x->expected[i]);
+  }
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->recieved = x->recieved;
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   
   int i;
@@ -122,13 +156,14 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char *fmt, ...) {
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
+static MPC_THREAD_LOCAL char char_unescape_buffer[4];
 
 static char *mpc_err_char_unescape(char c) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
   char_unescape_buffer[2] = '\'';
+  char_unescape_buffer[3] = '\0';
   
   switch (c) {
     
@@ -179,7 +214,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->recieved));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
@@ -320,11 +355,13 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  int length;
   char *buffer;
   FILE *file;
   
   int backtrack;
   int marks_num;
+  int marks_slots;
   mpc_state_t* marks;
   char* lasts;
   
@@ -342,13 +379,15 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
+  memcpy(i->string, string, i->length + 1);
   i->buffer = NULL;
   i->file = NULL;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
 
@@ -368,11 +407,13 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -392,11 +433,13 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
   i->backtrack = 1;
   i->marks_num = 0;
+  i->marks_slots = 0;
   i->marks = NULL;
   i->lasts = NULL;
   
@@ -425,8 +468,11 @@ static void mpc_input_mark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num++;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
+  if (i->marks_num > i->marks_slots) {
+    i->marks_slots = i->marks_num * 2;
+    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
+    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
+  }
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
   
@@ -441,8 +487,6 @@ static void mpc_input_unmark(mpc_input_t *i) {
   if (i->backtrack < 1) { return; }
   
   i->marks_num--;
-  i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_num);
-  i->lasts = realloc(i->lasts, sizeof(char) * i->marks_num);
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
     free(i->buffer);
@@ -474,7 +518,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->state.pos == i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -684,7 +728,10 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_DFA       = 25,
+  MPC_TYPE_MEMO      = 26
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -702,6 +749,8 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { int n; char *quants; unsigned int *table; char *expected; } mpc_pdata_dfa_t;
+typedef struct { mpc_parser_t *x; } mpc_pdata_memo_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -719,6 +768,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_memo_t memo;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -728,6 +779,170 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** DFA Input
+**
+** A DFA parser stores one bit per item of its
+** regex in a table indexed by byte value, so
+** testing a character against the current item
+** is a single lookup. Runs of `*` and `+` items
+** are scanned in a tight loop and for string
+** input the whole match is done in place without
+** going through the per character input functions.
+*/
+
+static int mpc_input_dfa_string(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+  
+  const unsigned char *s = (const unsigned char*)i->string + i->state.pos;
+  const unsigned int *t = d->table;
+  unsigned int bit;
+  int j = 0, k, l;
+  
+  for (k = 0; k < d->n; k++) {
+    bit = 1u << k;
+    switch (d->quants[k]) {
+      case '*': while (t[s[j]] & bit) { j++; } break;
+      case '?': if (t[s[j]] & bit) { j++; } break;
+      case '+': if (!(t[s[j]] & bit)) { return 0; } j++; while (t[s[j]] & bit) { j++; } break;
+      default:  if (!(t[s[j]] & bit)) { return 0; } j++; break;
+    }
+  }
+  
+  for (l = 0; l < j; l++) {
+    i->state.col++;
+    if (s[l] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+  
+  if (j > 0) { i->last = s[j-1]; }
+  i->state.pos += j;
+  
+  *o = malloc(j + 1);
+  memcpy(*o, s, j);
+  (*o)[j] = '\0';
+  return 1;
+}
+
+static int mpc_input_dfa_char(mpc_input_t *i, unsigned int *t, unsigned int bit, char **o, int *n) {
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { return 0; }
+  if (!(t[(unsigned char)x] & bit)) { return mpc_input_failure(i, x); }
+  *o = realloc(*o, *n + 2);
+  (*o)[(*n)++] = x;
+  (*o)[*n] = '\0';
+  return mpc_input_success(i, x, NULL);
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_pdata_dfa_t *d, char **o) {
+  
+  unsigned int bit;
+  int k, n = 0;
+  
+  if (i->type == MPC_INPUT_STRING) { return mpc_input_dfa_string(i, d, o); }
+  
+  *o = calloc(1, 1);
+  mpc_input_mark(i);
+  
+  for (k = 0; k < d->n; k++) {
+    bit = 1u << k;
+    if (d->quants[k] == '\0' || d->quants[k] == '+') {
+      if (!mpc_input_dfa_char(i, d->table, bit, o, &n)) {
+        mpc_input_rewind(i);
+        free(*o);
+        return 0;
+      }
+    }
+    if (d->quants[k] == '?') {
+      mpc_input_dfa_char(i, d->table, bit, o, &n);
+    }
+    if (d->quants[k] == '*' || d->quants[k] == '+') {
+      while (mpc_input_dfa_char(i, d->table, bit, o, &n));
+    }
+  }
+  
+  mpc_input_unmark(i);
+  return 1;
+}
+
+/*
+** Arena Type
+**
+** An arena hands out memory from a chain of
+** large blocks with a bump pointer. While
+** `mpc_parse_arena` runs, every AST node, tag,
+** contents string and child array is carved out
+** of the arena and the parser stacks are reused
+** from the previous parse, so deleting the
+** result is just resetting the arena.
+**
+** `mpc_ast_delete` does nothing while an arena
+** is active because the memory is released all
+** at once by `mpc_arena_reset`.
+*/
+
+enum { MPC_ARENA_BLOCK = 64 * 1024 };
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  size_t used;
+  char *data;
+} mpc_arena_block_t;
+
+struct mpc_arena_t {
+  mpc_arena_block_t *head;
+  mpc_arena_block_t *curr;
+  void *stack;
+};
+
+static MPC_THREAD_LOCAL mpc_arena_t *mpc_arena_current = NULL;
+
+static mpc_arena_block_t *mpc_arena_block_new(size_t size) {
+  mpc_arena_block_t *b = malloc(sizeof(mpc_arena_block_t));
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  b->data = malloc(size);
+  return b;
+}
+
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->head = mpc_arena_block_new(MPC_ARENA_BLOCK);
+  a->curr = a->head;
+  a->stack = NULL;
+  return a;
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  
+  mpc_arena_block_t *b;
+  void *x;
+  
+  n = (n + 7) & ~(size_t)7;
+  
+  while (a->curr->used + n > a->curr->size) {
+    if (a->curr->next == NULL || n > a->curr->next->size) {
+      b = mpc_arena_block_new(n > MPC_ARENA_BLOCK ? n : MPC_ARENA_BLOCK);
+      b->next = a->curr->next;
+      a->curr->next = b;
+    }
+    a->curr = a->curr->next;
+  }
+  
+  x = a->curr->data + a->curr->used;
+  a->curr->used += n;
+  return x;
+}
+
+void mpc_arena_reset(mpc_arena_t *a) {
+  mpc_arena_block_t *b;
+  for (b = a->head; b != NULL; b = b->next) { b->used = 0; }
+  a->curr = a->head;
+}
+
 /*
 ** Stack Type
 */
@@ -746,10 +961,26 @@ typedef struct {
   
   mpc_err_t *err;
   
+  int memo_num;
+  int memo_slots;
+  struct mpc_memo_t *memo;
+  
 } mpc_stack_t;
 
 static mpc_stack_t *mpc_stack_new(const char *filename) {
-  mpc_stack_t *s = malloc(sizeof(mpc_stack_t));
+  mpc_stack_t *s;
+  
+  if (mpc_arena_current && mpc_arena_current->stack) {
+    s = mpc_arena_current->stack;
+    mpc_arena_current->stack = NULL;
+    s->parsers_num = 0;
+    s->results_num = 0;
+    s->memo_num = 0;
+    s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
+    return s;
+  }
+  
+  s = malloc(sizeof(mpc_stack_t));
   
   s->parsers_num = 0;
   s->parsers_slots = 0;
@@ -761,11 +992,24 @@ static mpc_stack_t *mpc_stack_new(const char *filename) {
   s->results = NULL;
   s->returns = NULL;
   
+  s->memo_num = 0;
+  s->memo_slots = 0;
+  s->memo = NULL;
+  
   s->err = mpc_err_fail(filename, mpc_state_invalid(), "Unknown Error");
   
   return s;
 }
 
+static void mpc_stack_delete(mpc_stack_t *s) {
+  free(s->parsers);
+  free(s->states);
+  free(s->results);
+  free(s->returns);
+  free(s->memo);
+  free(s);
+}
+
 static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   mpc_err_t *errs[2];
   errs[0] = s->err;
@@ -773,9 +1017,13 @@ static void mpc_stack_err(mpc_stack_t *s, mpc_err_t* e) {
   s->err = mpc_err_or(errs, 2);
 }
 
+static void mpc_stack_memo_clear(mpc_stack_t *s);
+
 static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
   int success = s->returns[0];
   
+  mpc_stack_memo_clear(s);
+  
   if (success) {
     r->output = s->results[0].output;
     mpc_err_delete(s->err);
@@ -784,15 +1032,121 @@ static int mpc_stack_terminate(mpc_stack_t *s, mpc_result_t *r) {
     r->error = s->err;
   }
   
-  free(s->parsers);
-  free(s->states);
-  free(s->results);
-  free(s->returns);
-  free(s);
+  if (mpc_arena_current && mpc_arena_current->stack == NULL) {
+    mpc_arena_current->stack = s;
+  } else {
+    mpc_stack_delete(s);
+  }
   
   return success;
 }
 
+/* Stack Memo Stuff */
+
+/*
+** Packrat parsing keeps the result of every
+** memoized parser at every input position in
+** an open addressed table on the stack, so
+** a rule is never run twice at the same place.
+** Outputs are ASTs which the table shares with
+** the parsers it returns them to, by reference
+** counting. A parent only ever changes the root
+** of what it's given, so the root is copied
+** just before being changed if it's shared.
+*/
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  int pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t result;
+} mpc_memo_t;
+
+static MPC_THREAD_LOCAL long mpc_memo_hits = 0;
+static MPC_THREAD_LOCAL long mpc_memo_misses = 0;
+
+static mpc_ast_t *mpc_ast_retain(mpc_ast_t *a);
+
+static unsigned long mpc_memo_hash(mpc_parser_t *p, int pos) {
+  unsigned long h = (unsigned long)p;
+  h ^= (unsigned long)pos * 2654435761ul;
+  h ^= h >> 15;
+  return h * 2246822519ul;
+}
+
+static mpc_memo_t *mpc_stack_memo_find(mpc_stack_t *s, mpc_parser_t *p, int pos) {
+  
+  unsigned long h;
+  mpc_memo_t *m;
+  
+  if (s->memo_slots == 0) { return NULL; }
+  
+  h = mpc_memo_hash(p, pos) & (s->memo_slots - 1);
+  while (1) {
+    m = &s->memo[h];
+    if (m->p == NULL) { return m; }
+    if (m->p == p && m->pos == pos) { return m; }
+    h = (h + 1) & (s->memo_slots - 1);
+  }
+}
+
+static void mpc_stack_memo_reserve(mpc_stack_t *s) {
+  
+  int i, n = s->memo_slots;
+  mpc_memo_t *old = s->memo;
+  
+  if (s->memo_num * 2 < s->memo_slots) { return; }
+  
+  s->memo_slots = n ? n * 2 : 64;
+  s->memo = calloc(s->memo_slots, sizeof(mpc_memo_t));
+  for (i = 0; i < n; i++) {
+    if (old[i].p) { *mpc_stack_memo_find(s, old[i].p, old[i].pos) = old[i]; }
+  }
+  free(old);
+}
+
+static void mpc_stack_memo_store(mpc_stack_t *s, mpc_parser_t *p, int pos, mpc_input_t *i, mpc_result_t r, int success) {
+  
+  mpc_memo_t *m;
+  
+  mpc_stack_memo_reserve(s);
+  m = mpc_stack_memo_find(s, p, pos);
+  if (m->p != NULL) { return; }
+  
+  s->memo_num++;
+  m->p = p;
+  m->pos = pos;
+  m->success = success;
+  m->state = i->state;
+  m->last = i->last;
+  if (success) {
+    m->result.output = mpc_ast_retain(r.output);
+  } else {
+    m->result.error = mpc_err_copy(r.error);
+  }
+}
+
+static void mpc_stack_memo_clear(mpc_stack_t *s) {
+  int i;
+  for (i = 0; i < s->memo_slots; i++) {
+    if (s->memo[i].p == NULL) { continue; }
+    if (s->memo[i].success) {
+      mpc_ast_delete(s->memo[i].result.output);
+    } else {
+      mpc_err_delete(s->memo[i].result.error);
+    }
+    s->memo[i].p = NULL;
+  }
+  s->memo_num = 0;
+}
+
+void mpc_memo_stats(long *hits, long *misses) {
+  *hits = mpc_memo_hits;
+  *misses = mpc_memo_misses;
+}
+
 /* Stack Parser Stuff */
 
 static void mpc_stack_set_state(mpc_stack_t *s, int x) {
@@ -801,15 +1155,7 @@ static void mpc_stack_set_state(mpc_stack_t *s, int x) {
 
 static void mpc_stack_parsers_reserve_more(mpc_stack_t *s) {
   if (s->parsers_num > s->parsers_slots) {
-    s->parsers_slots = ceil((s->parsers_slots+1) * 1.5);
-    s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
-    s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
-  }
-}
-
-static void mpc_stack_parsers_reserve_less(mpc_stack_t *s) {
-  if (s->parsers_slots > pow(s->parsers_num+1, 1.5)) {
-    s->parsers_slots = floor((s->parsers_slots-1) * (1.0/1.5));
+    s->parsers_slots = s->parsers_num * 2;
     s->parsers = realloc(s->parsers, sizeof(mpc_parser_t*) * s->parsers_slots);
     s->states = realloc(s->states, sizeof(int) * s->parsers_slots);
   }
@@ -826,7 +1172,6 @@ static void mpc_stack_popp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
   *p = s->parsers[s->parsers_num-1];
   *st = s->states[s->parsers_num-1];
   s->parsers_num--;
-  mpc_stack_parsers_reserve_less(s);
 }
 
 static void mpc_stack_peepp(mpc_stack_t *s, mpc_parser_t **p, int *st) {
@@ -854,15 +1199,7 @@ static mpc_result_t mpc_result_out(mpc_val_t *x) {
 
 static void mpc_stack_results_reserve_more(mpc_stack_t *s) {
   if (s->results_num > s->results_slots) {
-    s->results_slots = ceil((s->results_slots + 1) * 1.5);
-    s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
-    s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
-  }
-}
-
-static void mpc_stack_results_reserve_less(mpc_stack_t *s) {
-  if ( s->results_slots > pow(s->results_num+1, 1.5)) {
-    s->results_slots = floor((s->results_slots-1) * (1.0/1.5));
+    s->results_slots = s->results_num * 2;
     s->results = realloc(s->results, sizeof(mpc_result_t) * s->results_slots);
     s->returns = realloc(s->returns, sizeof(int) * s->results_slots);
   }
@@ -880,7 +1217,6 @@ static int mpc_stack_popr(mpc_stack_t *s, mpc_result_t *x) {
   *x = s->results[s->results_num-1];
   r = s->returns[s->results_num-1];
   s->results_num--;
-  mpc_stack_results_reserve_less(s);
   return r;
 }
 
@@ -972,6 +1308,7 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
   /* Variables */
   char *s;
   mpc_result_t r;
+  mpc_memo_t *m;
 
   /* Go! */
   mpc_stack_pushp(stk, init);
@@ -991,6 +1328,10 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
       case MPC_TYPE_NONEOF:    MPC_PRIMATIVE(s, mpc_input_noneof(i, p->data.string.x, &s));
       case MPC_TYPE_SATISFY:   MPC_PRIMATIVE(s, mpc_input_satisfy(i, p->data.satisfy.f, &s));
       case MPC_TYPE_STRING:    MPC_PRIMATIVE(s, mpc_input_string(i, p->data.string.x, &s));
+      case MPC_TYPE_DFA:
+        if (mpc_input_dfa(i, &p->data.dfa, &s)) { MPC_SUCCESS(s); }
+        if (p->data.dfa.expected) { MPC_FAILURE(mpc_err_new(i->filename, i->state, p->data.dfa.expected, mpc_input_peekc(i))); }
+        MPC_FAILURE(mpc_err_fail(i->filename, i->state, "Incorrect Input"));
       
       /* Other parsers */
       
@@ -1049,6 +1390,37 @@ int mpc_parse_input(mpc_input_t *i, mpc_parser_t *init, mpc_result_t *final) {
           continue;
         }
       
+      /* Memo Parsers */
+      
+      case MPC_TYPE_MEMO:
+        if (i->type != MPC_INPUT_STRING) {
+          if (st == 0) { MPC_CONTINUE(1, p->data.memo.x); }
+          mpc_stack_popp(stk, &p, &st);
+          continue;
+        }
+        if (st == 0) {
+          m = mpc_stack_memo_find(stk, p, i->state.pos);
+          if (m == NULL || m->p == NULL) {
+            mpc_memo_misses++;
+            MPC_CONTINUE(i->state.pos + 1, p->data.memo.x);
+          }
+          mpc_memo_hits++;
+          i->state = m->state;
+          i->last = m->last;
+          if (m->success) {
+            MPC_SUCCESS(mpc_ast_retain(m->result.output));
+          } else {
+            MPC_FAILURE(mpc_err_copy(m->result.error));
+          }
+        }
+        if (mpc_stack_peekr(stk, &r)) {
+          mpc_stack_memo_store(stk, p, st - 1, i, r, 1);
+        } else {
+          mpc_stack_memo_store(stk, p, st - 1, i, r, 0);
+        }
+        mpc_stack_popp(stk, &p, &st);
+        continue;
+      
       /* Optional Parsers */
       
       /* TODO: Update Not Error Message */
@@ -1187,6 +1559,26 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r) {
+  int x;
+  mpc_arena_t *prev = mpc_arena_current;
+  mpc_arena_current = a;
+  x = mpc_parse(filename, string, p, r);
+  mpc_arena_current = prev;
+  return x;
+}
+
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_block_t *b, *n;
+  for (b = a->head; b != NULL; b = n) {
+    n = b->next;
+    free(b->data);
+    free(b);
+  }
+  if (a->stack) { mpc_stack_delete(a->stack); }
+  free(a);
+}
+
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_file(filename, file);
@@ -1263,6 +1655,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1283,6 +1676,12 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
     case MPC_TYPE_AND: mpc_undefine_and(p); break;
     
+    case MPC_TYPE_DFA:
+      free(p->data.dfa.quants);
+      free(p->data.dfa.table);
+      free(p->data.dfa.expected);
+      break;
+    
     default: break;
   }
   
@@ -1444,15 +1843,32 @@ mpc_parser_t *mpc_state(void) {
   return p;
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
+/*
+** Takes ownership of `expected`. A DFA reports
+** the expectation itself when it fails, which
+** saves building an error just to replace it.
+*/
+static mpc_parser_t *mpc_expect_take(mpc_parser_t *a, char *expected) {
+  mpc_parser_t *p;
+  
+  if (a->type == MPC_TYPE_DFA && !a->retained && a->data.dfa.expected == NULL) {
+    a->data.dfa.expected = expected;
+    return a;
+  }
+  
+  p = mpc_undefined();
   p->type = MPC_TYPE_EXPECT;
   p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
+  p->data.expect.m = expected;
   return p;
 }
 
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  char *m = malloc(strlen(expected) + 1);
+  strcpy(m, expected);
+  return mpc_expect_take(a, m);
+}
+
 /*
 ** As `snprintf` is not ANSI standard this 
 ** function `mpc_expectf` should be considered
@@ -1476,9 +1892,6 @@ mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
 mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   va_list va;
   char *buffer;
-
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
   
   va_start(va, fmt);
   buffer = malloc(2048);
@@ -1486,9 +1899,7 @@ mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
   va_end(va);
   
   buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+  return mpc_expect_take(a, buffer);
 }
 
 /*
@@ -1942,23 +2353,17 @@ static char *mpc_re_range_escape_char(char c) {
   }
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+static char *mpc_re_range_chars(const char *s, int *comp) {
   
-  mpc_parser_t *out;
   char *range = calloc(1,1);
   char *tmp = NULL;
-  char *s = x;
   char start, end;
   int i, j;
-  int comp = 0;
-  
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
   
-  if (s[0] == '^') { comp = 1;}
+  *comp = 0;
+  if (s[0] == '^') { *comp = 1;}
   
-  for (i = comp; i < strlen(s); i++){
+  for (i = *comp; i < strlen(s); i++){
     
     /* Regex Range Escape */
     if (s[i] == '\\') {
@@ -1999,6 +2404,21 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   
   }
   
+  return range;
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  char *range;
+  char *s = x;
+  int comp;
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  range = mpc_re_range_chars(s, &comp);
   out = comp ? mpc_noneof(range) : mpc_oneof(range);
   
   free(x);
@@ -2007,6 +2427,107 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Compiling Regular Expressions to DFAs
+**
+** Because mpc repetition is greedy and never
+** gives back what it has consumed, a regex that
+** is only a sequence of characters, escapes, `.`
+** and ranges, each with an optional `*`, `+` or
+** `?`, can be matched left to right without ever
+** backtracking. Those get compiled into a single
+** byte class table with one bit per item.
+**
+** Anything using groups, alternation, counts,
+** anchors or the look-ahead escapes is left to
+** the combinator compiler below.
+*/
+
+enum { MPC_DFA_MAX = 32 };
+
+static void mpc_re_dfa_set(unsigned int *table, int k, const char *chars, int comp) {
+  int c;
+  for (c = 1; c < 256; c++) {
+    if ((strchr(chars, c) != NULL) != comp) { table[c] |= 1u << k; }
+  }
+}
+
+static mpc_parser_t *mpc_re_dfa(const char *re) {
+  
+  mpc_parser_t *p;
+  unsigned int *table = calloc(256, sizeof(unsigned int));
+  char *quants = calloc(MPC_DFA_MAX, 1);
+  char *range, *chars;
+  char single[2] = { '\0', '\0' };
+  const char *s = re;
+  int n = 0, j, comp;
+  
+  while (*s) {
+    
+    if (n == MPC_DFA_MAX || strchr("()|{^$", *s)) { goto fallback; }
+    
+    /* Range */
+    if (*s == '[') {
+      for (j = 1; s[j] && s[j] != ']'; j++) {
+        if (s[j] == '\\' && s[j+1]) { j++; }
+      }
+      if (s[j] != ']' || j == 1 || (j == 2 && s[1] == '^')) { goto fallback; }
+      range = malloc(j);
+      memcpy(range, s + 1, j - 1);
+      range[j-1] = '\0';
+      chars = mpc_re_range_chars(range, &comp);
+      mpc_re_dfa_set(table, n, chars, comp);
+      free(chars);
+      free(range);
+      s += j + 1;
+    }
+    
+    /* Escape */
+    else if (*s == '\\') {
+      if (s[1] == '\0' || strchr("bBAZDSW", s[1])) { goto fallback; }
+      switch (s[1]) {
+        case 'd': mpc_re_dfa_set(table, n, "0123456789", 0); break;
+        case 's': mpc_re_dfa_set(table, n, " \f\n\r\t\v", 0); break;
+        case 'w': mpc_re_dfa_set(table, n, mpc_re_range_escape_char('w'), 0); break;
+        default:
+          single[0] = (s[1] == 'a') ? '\a' : (s[1] == 'f') ? '\f' : (s[1] == 'n') ? '\n'
+                    : (s[1] == 'r') ? '\r' : (s[1] == 't') ? '\t' : (s[1] == 'v') ? '\v' : s[1];
+          mpc_re_dfa_set(table, n, single, 0);
+      }
+      s += 2;
+    }
+    
+    /* Any */
+    else if (*s == '.') {
+      mpc_re_dfa_set(table, n, "", 1);
+      s++;
+    }
+    
+    /* Standard */
+    else {
+      single[0] = *s;
+      mpc_re_dfa_set(table, n, single, 0);
+      s++;
+    }
+    
+    if (*s == '*' || *s == '+' || *s == '?') { quants[n] = *s; s++; }
+    n++;
+  }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.n = n;
+  p->data.dfa.quants = quants;
+  p->data.dfa.table = table;
+  p->data.dfa.expected = NULL;
+  return p;
+  
+fallback:
+  free(table);
+  free(quants);
+  return NULL;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2014,6 +2535,10 @@ mpc_parser_t *mpc_re(const char *re) {
   mpc_result_t r;
   mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
   
+  /* DFA matching fails without saying what it wanted, so name the regex */
+  mpc_parser_t *dfa = mpc_re_dfa(re);
+  if (dfa != NULL) { return mpc_expectf(dfa, "/%s/", re); }
+  
   Regex  = mpc_new("regex");
   Term   = mpc_new("term");
   Factor = mpc_new("factor");
@@ -2066,6 +2591,58 @@ mpc_parser_t *mpc_re(const char *re) {
   
 }
 
+/*
+** Precompiled Regex
+**
+** `mpc_dfa_print` writes the tables `mpc_re`
+** would build for a regex out as C arrays, and
+** `mpc_dfa` turns those arrays back into a
+** parser without compiling anything, so a
+** program can generate its regexes ahead of
+** time.
+*/
+
+mpc_parser_t *mpc_dfa(int n, const char *quants, const unsigned int *table) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.n = n;
+  p->data.dfa.quants = calloc(MPC_DFA_MAX, 1);
+  p->data.dfa.table = malloc(256 * sizeof(unsigned int));
+  memcpy(p->data.dfa.quants, quants, n);
+  memcpy(p->data.dfa.table, table, 256 * sizeof(unsigned int));
+  p->data.dfa.expected = NULL;
+  return p;
+}
+
+int mpc_dfa_print(const char *name, const char *re) {
+  
+  int k;
+  mpc_parser_t *p = mpc_re_dfa(re);
+  if (p == NULL) { return 0; }
+  
+  printf("static const char %s_re[] = \"", name);
+  for (k = 0; re[k]; k++) {
+    if (re[k] == '\\' || re[k] == '"') { putchar('\\'); }
+    putchar(re[k]);
+  }
+  printf("\";\n");
+  printf("static const int %s_n = %i;\n", name, p->data.dfa.n);
+  printf("static const char %s_quants[] = {", name);
+  for (k = 0; k < p->data.dfa.n; k++) {
+    if (p->data.dfa.quants[k]) { printf(" '%c',", p->data.dfa.quants[k]); }
+    else { printf(" 0,"); }
+  }
+  printf(" 0 };\n");
+  printf("static const unsigned int %s_table[256] = {", name);
+  for (k = 0; k < 256; k++) {
+    printf("%s0x%x,", k % 8 ? " " : "\n  ", p->data.dfa.table[k]);
+  }
+  printf("\n};\n");
+  
+  mpc_delete(p);
+  return 1;
+}
+
 /*
 ** Common Fold Functions
 */
@@ -2312,6 +2889,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   }
   
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_DFA) { printf("<dfa>"); }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
 
   if (p->type == MPC_TYPE_SINGLE) {
@@ -2370,6 +2948,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2475,11 +3054,22 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
 ** AST
 */
 
+static void *mpc_ast_malloc(size_t n) {
+  return mpc_arena_current ? mpc_arena_alloc(mpc_arena_current, n) : malloc(n);
+}
+
+static char *mpc_ast_strdup(const char *x) {
+  char *y = mpc_ast_malloc(strlen(x) + 1);
+  strcpy(y, x);
+  return y;
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
   
   int i;
   
-  if (a == NULL) { return; }
+  if (a == NULL || mpc_arena_current) { return; }
+  if (--a->refs > 0) { return; }
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2492,6 +3082,7 @@ void mpc_ast_delete(mpc_ast_t *a) {
 }
 
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (mpc_arena_current) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
@@ -2500,18 +3091,16 @@ static void mpc_ast_delete_no_children(mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
   
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_ast_malloc(sizeof(mpc_ast_t));
   
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
-  
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
+  a->tag = mpc_ast_strdup(tag);
+  a->contents = mpc_ast_strdup(contents);
   
   a->state = mpc_state_new();
   
   a->children_num = 0;
   a->children = NULL;
+  a->refs = 1;
   return a;
   
 }
@@ -2547,6 +3136,32 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   return r;
 }
 
+static mpc_ast_t *mpc_ast_retain(mpc_ast_t *a) {
+  if (a != NULL) { a->refs++; }
+  return a;
+}
+
+/*
+** Before changing the root of a tree the memo
+** table shares, copy just the root, with the
+** copy taking new references to the children.
+*/
+static mpc_ast_t *mpc_ast_unshare(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *r;
+  
+  if (a == NULL || a->refs == 1) { return a; }
+  
+  r = mpc_ast_new(a->tag, a->contents);
+  r->state = a->state;
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_add_child(r, mpc_ast_retain(a->children[i]));
+  }
+  a->refs--;
+  return r;
+}
+
 int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
   
   int i;
@@ -2563,15 +3178,37 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  
+  mpc_ast_t **children;
+  int n = r->children_num;
+  
+  /* In an arena the array grows by doubling as it can't be reallocated */
+  if (mpc_arena_current) {
+    if (n == 0 || (n & (n - 1)) == 0) {
+      children = mpc_ast_malloc(sizeof(mpc_ast_t*) * (n == 0 ? 1 : n * 2));
+      if (n) { memcpy(children, r->children, sizeof(mpc_ast_t*) * n); }
+      r->children = children;
+    }
+  } else {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * (n + 1));
+  }
+  
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  char *tag;
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  a = mpc_ast_unshare(a);
+  if (mpc_arena_current) {
+    tag = mpc_ast_malloc(strlen(t) + 1 + strlen(a->tag) + 1);
+    strcpy(tag, a->tag);
+    a->tag = tag;
+  } else {
+    a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  }
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2579,6 +3216,11 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a = mpc_ast_unshare(a);
+  if (mpc_arena_current) {
+    a->tag = mpc_ast_strdup(t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -2586,6 +3228,7 @@ mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
+  a = mpc_ast_unshare(a);
   a->state = s;
   return a;
 }
@@ -2630,11 +3273,17 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     
     if (as[i] && as[i]->children_num > 0) {
       
+      /* Children of a shared root are shared with it */
       for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
+        mpc_ast_add_child(r, as[i]->refs > 1 ?
+          mpc_ast_retain(as[i]->children[j]) : as[i]->children[j]);
       }
       
-      mpc_ast_delete_no_children(as[i]);
+      if (as[i]->refs > 1) {
+        as[i]->refs--;
+      } else {
+        mpc_ast_delete_no_children(as[i]);
+      }
       
     } else if (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
@@ -2733,6 +3382,13 @@ mpc_parser_t *mpca_and(int n, ...) {
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
 
+mpc_parser_t *mpca_memo(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  return p;
+}
+
 /*
 ** Grammar Parser
 */
@@ -3039,6 +3695,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     stmt = *stmts;
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_memo(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -246,6 +246,18 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 */
 
 mpc_parser_t *mpc_re(const char *re);
+
+/*
+** Print the tables for a simple regex as C
+** arrays named after `name`, and build a parser
+** from those arrays. `mpc_dfa_print` returns 0
+** if the regex is too complex to be printed.
+** The regex itself is printed as `name_re`, for
+** naming in errors with `mpc_expectf`.
+*/
+
+int mpc_dfa_print(const char *name, const char *re);
+mpc_parser_t *mpc_dfa(int n, const char *quants, const unsigned int *table);
   
 /*
 ** AST
@@ -257,6 +269,7 @@ typedef struct mpc_ast_t {
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int refs;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -270,6 +283,20 @@ mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 
+/*
+** Parsing into an arena allocates the whole AST
+** from `a`. Don't call `mpc_ast_delete` on the
+** result; use `mpc_arena_reset` to free it.
+*/
+
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_reset(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -284,6 +311,7 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
+mpc_parser_t *mpca_memo(mpc_parser_t *a);
 
 mpc_parser_t *mpca_not(mpc_parser_t *a);
 mpc_parser_t *mpca_maybe(mpc_parser_t *a);
@@ -298,7 +326,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -314,6 +343,14 @@ mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
 void mpc_print(mpc_parser_t *p);
 
+/*
+** Number of times a parser wrapped in `mpca_memo`
+** was answered from the memo table (hits) or had
+** to actually run (misses).
+*/
+
+void mpc_memo_stats(long *hits, long *misses);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, void *d,
   int(*tester)(void*, void*), 
   mpc_dtor_t destructor, 
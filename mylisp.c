@@ -1,25 +1,37 @@
+/* isatty is POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "dbg.h"
 
 #include "mpc.h"
 #include "eval.h"
 #include "lval.h"
+#include "reader.h"
 
 /* If we are compiling on Windws, compile these functions */
 #ifdef _WIN32
 
+#include <io.h>
 #include <string.h>
 
-static char buffer[2048];
+#define isatty _isatty
+#define STDIN_FILENO 0
 
 /* Fake Windows readline function */
 char *readline(char *prompt)
 {
+	char buffer[2048];
 	fputs(prompt, stdout);
-	fgets(buffer, 2048, stdin);
+	if (fgets(buffer, 2048, stdin) == NULL)
+		return NULL;
 	/* TODO(jfriedly):  is strlen() safe against buffer overflows? */
 	/* I tried to force it to overflow, but it didn't work. */
 	char *cpy = malloc(strlen(buffer) + 1);
@@ -31,29 +43,32 @@ char *readline(char *prompt)
 /* Fake Windows add_history function */
 void add_history(char *unused) {}
 
+/* Fake Windows callback interface, which reads a whole line at once */
+static char *fake_prompt;
+static void (*fake_handler)(char *line);
+
+void rl_callback_handler_install(char *prompt, void (*handler)(char *line))
+{
+	fake_prompt = prompt;
+	fake_handler = handler;
+}
+
+void rl_callback_read_char(void)
+{
+	fake_handler(readline(fake_prompt));
+}
+
+void rl_callback_handler_remove(void) {}
+
 /* If we're not on Windows, include editline here */
 #else
 
+#include <unistd.h>
 #include <editline/readline.h>
 #include <editline/history.h>
 
 #endif
 
-/* Attempt to parse the user input */
-mpc_ast_t *parse(mpc_parser_t *parser, char *input)
-{
-	mpc_result_t r;
-	debug("Parsing...");
-	if (!mpc_parse("<stdin>", input, parser, &r)) {
-		log_err("Failed to parse expression:");
-		mpc_err_print(r.error);
-		mpc_err_delete(r.error);
-		return NULL;
-	}
-	debug("Parsed into an AST successfully.");
-	return r.output;
-}
-
 void lenv_add_builtins(struct lenv *env)
 {
 	lenv_add_builtin(env, "car", builtin_car);
@@ -84,48 +99,111 @@ void lenv_add_builtins(struct lenv *env)
 	lenv_add_builtin(env, "<=", builtin_leq);
 	lenv_add_builtin(env, ">", builtin_g);
 	lenv_add_builtin(env, "<", builtin_l);
+	lenv_add_builtin(env, "to-string", builtin_to_string);
+	lenv_add_builtin(env, "substring", builtin_substring);
+	lenv_add_builtin(env, "concat", builtin_concat);
+	lenv_add_builtin(env, "to-bytes", builtin_to_bytes);
+	lenv_add_builtin(env, "byte-at", builtin_byte_at);
+	lenv_add_builtin(env, "hashmap", builtin_hashmap);
+	lenv_add_builtin(env, "get", builtin_get);
+	lenv_add_builtin(env, "put", builtin_put);
+	lenv_add_builtin(env, "remove", builtin_remove);
+	lenv_add_builtin(env, "has", builtin_has);
+	lenv_add_builtin(env, "entries", builtin_entries);
+	lenv_add_builtin(env, "vector", builtin_vector);
+	lenv_add_builtin(env, "conj", builtin_conj);
+	lenv_add_builtin(env, "assoc", builtin_assoc);
+	lenv_add_builtin(env, "nth", builtin_nth);
+	lenv_add_builtin(env, "pmap", builtin_pmap);
+	lenv_add_builtin(env, "isolate", builtin_isolate);
+	lenv_add_builtin(env, "isolate-join", builtin_isolate_join);
+	lenv_add_builtin(env, "future", builtin_future);
+	lenv_add_builtin(env, "touch", builtin_touch);
+	lenv_add_builtin(env, "channel", builtin_channel);
+	lenv_add_builtin(env, "send", builtin_send);
+	lenv_add_builtin(env, "recv", builtin_recv);
+	lenv_add_builtin(env, "try-recv", builtin_try_recv);
+	lenv_add_builtin(env, "select", builtin_select);
+	lenv_add_builtin(env, "spawn", builtin_spawn);
+	lenv_add_builtin(env, "yield", builtin_yield);
+	lenv_add_builtin(env, "wait", builtin_wait);
+	lenv_add_builtin(env, "sleep", builtin_sleep);
+	lenv_add_builtin(env, "dump", builtin_dump);
+	lenv_add_builtin(env, "load-binary", builtin_load_binary);
+	lenv_add_builtin(env, "save-image", builtin_save_image);
+	lenv_add_builtin(env, "load", builtin_load);
+	lenv_add_builtin(env, "cache-stats", builtin_cache_stats);
+	lenv_add_builtin(env, "free-stats", builtin_free_stats);
+	lenv_add_builtin(env, "open", builtin_open);
+	lenv_add_builtin(env, "read-line", builtin_read_line);
+	lenv_add_builtin(env, "read-bytes", builtin_read_bytes);
+	lenv_add_builtin(env, "write", builtin_write);
+	lenv_add_builtin(env, "flush", builtin_flush);
+	lenv_add_builtin(env, "close", builtin_close);
+	lenv_add_builtin(env, "pipe", builtin_pipe);
+	lenv_add_builtin(env, "listen", builtin_listen);
+	lenv_add_builtin(env, "accept", builtin_accept);
+	lenv_add_builtin(env, "connect", builtin_connect);
 
 	lenv_set(env, lval_sym("T"), lval_bool(true));
 	lenv_set(env, lval_sym("F"), lval_bool(false));
 }
 
-int main(int argc, char **argv)
+/* Exit statuses, besides whatever is passed to (exit n) */
+#define STATUS_ERROR 1
+#define STATUS_USAGE 2
+
+/* Milliseconds the server waits after failing to accept a connection */
+#define SERVE_RETRY 100
+
+/* Limits from the command line for each evaluation, or 0 for none */
+static long max_steps;
+static long max_bytes;
+static long max_ms;
+
+/* A quota for an evaluation, or NULL if there are no limits */
+static struct lquota *limits(void)
 {
-	/* Create some mpc parsers */
-	mpc_parser_t *Number   = mpc_new("number");
-	mpc_parser_t *Symbol   = mpc_new("symbol");
-	mpc_parser_t *Expr     = mpc_new("expr");
-	mpc_parser_t *SExpr     = mpc_new("sexpr");
-	mpc_parser_t *MyLisp   = mpc_new("mylisp");
-	/* Define the parsers with the following language
-	 *
-	 * TODO(jfriedly):  Implement concepts of unary, binary, etc. symbols.
-	 * For example, (/ 1) should be a syntax error.
-	 */
-	mpca_lang(MPCA_LANG_DEFAULT,
-		"							\
-		number   : /-?[0-9.]+/ ;				\
-		symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!%^&]+/;		\
-		expr     : <number> | <symbol> | <sexpr> ;		\
-		sexpr    : '(' <expr>* ')' ;				\
-		mylisp   : /^/ <sexpr> /$/ ;",
-		Number, Symbol, Expr, SExpr, MyLisp);
+	if (max_steps == 0 && max_bytes == 0 && max_ms == 0)
+		return NULL;
+	return lquota_new(max_steps, max_bytes, max_ms);
+}
 
-	puts("My-lisp Version 0.0.0.0.1");
-	puts("Use (exit) to quit the REPL, or press Ctrl+C\n");
+static void repl_bye(void)
+{
+	/* Put the terminal back the way readline found it */
+	rl_callback_handler_remove();
+	printf("Bye.\n");
+}
 
-	/* TODO(jfriedly):  Why does initializing readline set ENOENT? */
-	rl_initialize();
-	errno = 0;
+/*
+ * The REPL reads input a character at a time with readline's callback
+ * interface, so that tasks can run on the event loop while it waits, and
+ * evaluates each form in repl_line once it's complete.
+ */
+static struct lenv *repl_env;
+/* One arena is reused for parsing every line */
+static mpc_arena_t *repl_arena;
+/* Lines are collected here until they make up a whole form */
+static struct reader *repl_reader;
+static bool repl_done;
 
-	struct lenv *env = lenv_new();
-	lenv_add_builtins(env);
+static void repl_line(char *input)
+{
+	/* EOF, e.g. Ctrl+D */
+	if (input == NULL) {
+		putchar('\n');
+		rl_callback_handler_remove();
+		repl_done = true;
+		return;
+	}
 
-	while (1) {
-		char *input = readline("my-lisp> ");
-		add_history(input);
+	add_history(input);
+	reader_feed(repl_reader, input);
+	free(input);
 
-		mpc_ast_t *ast = parse(MyLisp, input);
+	if (reader_complete(repl_reader)) {
+		mpc_ast_t *ast = reader_read(repl_reader, repl_arena);
 		if (ast != NULL) {
 			/*
 			 * To print the expression as it was parsed before
@@ -133,16 +211,339 @@ int main(int argc, char **argv)
 			 *
 			 * lval_println(stderr, lval_read(ast));
 			 */
-			struct lval *v = lval_eval(env, lval_read(ast));
+			struct lquota *prev = lquota_swap(limits());
+			struct lval *v = lval_eval(repl_env, lval_read(ast));
+			lquota_release(lquota_swap(prev));
 			lval_println(stdout, v);
 			lval_del(v);
-			mpc_ast_delete(ast);
 		}
 
-		free(input);
+		mpc_arena_reset(repl_arena);
+	}
+
+	rl_callback_handler_install(reader_empty(repl_reader) ?
+		"my-lisp> " : "      .. ", repl_line);
+}
+
+static void repl(struct lenv *env)
+{
+	puts("My-lisp Version 0.0.0.0.1");
+	puts("Use (exit) to quit the REPL, or press Ctrl+C\n");
+	atexit(repl_bye);
+
+	/* TODO(jfriedly):  Why does initializing readline set ENOENT? */
+	rl_initialize();
+	errno = 0;
+
+	repl_env = env;
+	repl_arena = mpc_arena_new();
+	repl_reader = reader_new();
+
+	rl_callback_handler_install("my-lisp> ", repl_line);
+	while (!repl_done) {
+		/* Tasks keep running until there's something to read */
+		levent_wait(STDIN_FILENO, false);
+		rl_callback_read_char();
+	}
+
+	reader_del(repl_reader);
+	mpc_arena_delete(repl_arena);
+}
+
+/*
+ * Parse and evaluate everything buffered in the reader, printing each result
+ * to stdout.  Errors are printed to stderr and stop evaluation.
+ */
+static int batch_eval(struct lenv *env, struct reader *reader,
+	mpc_arena_t *arena, const char *name)
+{
+	int status = 0;
+	char *error;
+	mpc_ast_t *ast = reader_read_program(reader, arena, name, &error);
+	if (ast == NULL) {
+		fputs(error, stderr);
+		free(error);
+		status = STATUS_ERROR;
+	} else {
+		struct lval *v = lload_eval(env, lval_read_program(ast),
+			stdout);
+		if (v->type == LVAL_ERR) {
+			lval_println(stderr, v);
+			status = STATUS_ERROR;
+		}
+		lval_del(v);
+	}
+	mpc_arena_reset(arena);
+	return status;
+}
+
+/*
+ * Evaluate a script or piped input as it's read, rather than reading all of
+ * it first.  Lines are collected until they make up whole forms, which are
+ * then evaluated before reading any further.
+ */
+static int batch_stream(struct lenv *env, struct reader *reader,
+	mpc_arena_t *arena, FILE *f, const char *name)
+{
+	char line[4096];
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		size_t n = strlen(line);
+		reader_write(reader, line, n);
+
+		/* A form can only end at the end of a line */
+		if (n == 0 || line[n - 1] != '\n')
+			continue;
+		if (!reader_complete(reader))
+			continue;
+
+		int status = batch_eval(env, reader, arena, name);
+		if (status != 0)
+			return status;
+	}
+
+	/* Anything left over is either whitespace or an unfinished form */
+	if (reader_empty(reader))
+		return 0;
+	return batch_eval(env, reader, arena, name);
+}
+
+static int batch(struct lenv *env, char **exprs, int nexprs, char *script)
+{
+	int status = 0;
+
+	/* Output only has to reach the terminal or pipe when we're done */
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+	mpc_arena_t *arena = mpc_arena_new();
+	struct reader *reader = reader_new();
+
+	if (nexprs > 0) {
+		for (int i = 0; i < nexprs && status == 0; i++) {
+			reader_feed(reader, exprs[i]);
+			status = batch_eval(env, reader, arena, "<expr>");
+		}
+	} else if (script == NULL || strcmp(script, "-") == 0) {
+		status = batch_stream(env, reader, arena, stdin, "<stdin>");
+	} else {
+		FILE *f = fopen(script, "r");
+		if (f == NULL) {
+			fprintf(stderr, "Could not open %s:  %s\n", script,
+				strerror(errno));
+			status = STATUS_USAGE;
+		} else {
+			status = batch_stream(env, reader, arena, f, script);
+			fclose(f);
+		}
+	}
+
+	/* Tasks the script spawned but didn't wait for still get to finish */
+	if (status == 0)
+		ltask_drain();
+
+	reader_del(reader);
+	mpc_arena_delete(arena);
+	fflush(stdout);
+	return status;
+}
+
+/* Write a result to a client, on a line of its own */
+static bool serve_reply(struct lport *out, struct lval *v)
+{
+	struct lbuf b;
+	lbuf_string(&b);
+	lbuf_lval(&b, v);
+	lbuf_putc(&b, '\n');
+	bool ok = lport_write(out, b.data, b.len);
+	if (b.data != b.fixed)
+		free(b.data);
+	return ok;
+}
+
+/*
+ * Talk to one client of the server, in a task of its own.  Forms are read a
+ * line at a time until they're complete, as in the REPL, and each result is
+ * sent back as soon as it's evaluated.  The task's environment is a child of
+ * the global one, so let binds for the rest of the connection while set
+ * binds for every connection.
+ */
+static struct lval *serve_client(struct lenv *env, struct lval *args)
+{
+	struct lport *in = args->cell[0]->val.port;
+	struct lport *out = args->cell[1]->val.port;
+	mpc_arena_t *arena = mpc_arena_new();
+	struct reader *reader = reader_new();
+	const char *line;
+	size_t len;
+	bool ok = true;
+
+	while (ok && (line = lport_read_line(in, &len)) != NULL) {
+		reader_write(reader, line, len);
+		reader_write(reader, "\n", 1);
+		if (!reader_complete(reader))
+			continue;
+
+		char *error;
+		mpc_ast_t *ast = reader_read_program(reader, arena, "<client>",
+			&error);
+		if (ast == NULL) {
+			ok = lport_write(out, error, strlen(error)) &&
+				lport_flush(out);
+			free(error);
+			mpc_arena_reset(arena);
+			continue;
+		}
+		struct lval *forms = lval_read_program(ast);
+		mpc_arena_reset(arena);
+		while (ok && forms->count > 0) {
+			/* Each form gets the limits to itself */
+			struct lquota *prev = lquota_swap(limits());
+			struct lval *v = lval_eval(env, lval_pop(forms, 0));
+			lquota_release(lquota_swap(prev));
+			ok = serve_reply(out, v) && lport_flush(out);
+			/* exit ends the connection rather than the server */
+			ok = ok && !lval_exited(v);
+			lval_del(v);
+		}
+		lval_del(forms);
+	}
+
+	reader_del(reader);
+	mpc_arena_delete(arena);
+	lport_close(out);
+	lport_close(in);
+	lval_del(args);
+	return lval_sexpr();
+}
+
+/*
+ * Serve clients on a Unix domain socket until the process is killed, each
+ * in its own task on this thread, so a client waiting for input or a timer
+ * doesn't hold up the others.
+ */
+static int serve(struct lenv *env, char *path)
+{
+	/* Left behind by a server that was killed */
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	struct lport *listener = lport_listen(path);
+	if (listener == NULL) {
+		fprintf(stderr, "Could not listen on %s:  %s\n", path,
+			strerror(errno));
+		return STATUS_USAGE;
+	}
+	fflush(stdout);
+
+	for (;;) {
+		struct lval *ports = lport_accept(listener);
+		if (ports->type == LVAL_ERR) {
+			/* Probably out of descriptors, until a client leaves */
+			lval_println(stderr, ports);
+			lval_del(ports);
+			levent_sleep(SERVE_RETRY);
+			continue;
+		}
+		ltask_release(ltask_spawn(env, lval_func(serve_client),
+			ports));
+	}
+}
+
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage:  %s [--image file] [--serve socket] "
+		"[--max-steps n] [--max-bytes n] [--max-ms n] "
+		"[-e expr]... [file | -] [args...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	char *image = NULL;
+	char *sock = NULL;
+	char *script = NULL;
+	char **exprs = malloc(sizeof(char*) * argc);
+	int nexprs = 0;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+			image = argv[++i];
+		} else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+			sock = argv[++i];
+		} else if (strcmp(argv[i], "--max-steps") == 0 &&
+			i + 1 < argc) {
+			max_steps = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--max-bytes") == 0 &&
+			i + 1 < argc) {
+			max_bytes = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--max-ms") == 0 && i + 1 < argc) {
+			max_ms = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			exprs[nexprs++] = argv[++i];
+		} else if (strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		} else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+			usage(argv[0]);
+			return STATUS_USAGE;
+		} else {
+			break;
+		}
+	}
+	/* With -e there's no script, and every other argument goes to argv */
+	if (nexprs == 0 && i < argc)
+		script = argv[i++];
+
+	reader_init();
+	/* exit ends the process from here, but not from tasks like clients */
+	lval_allow_exit(true);
+
+	/* Writing to a closed pipe or socket is an error, not the end */
+	signal(SIGPIPE, SIG_IGN);
+
+	struct lenv *env = lenv_new();
+	lenv_add_builtins(env);
+
+	/* Everything defined when the image was saved replaces the defaults */
+	if (image != NULL) {
+		struct lval *loaded = lserial_load_image(env, image);
+		if (loaded->type == LVAL_ERR) {
+			lval_println(stderr, loaded);
+			return STATUS_USAGE;
+		}
+		lval_del(loaded);
+	}
+
+	/* The arguments after the script or expressions */
+	struct lval *args = lval_sexpr();
+	for (; i < argc; i++)
+		args = lval_append(args, lval_string(argv[i], strlen(argv[i])));
+	struct lval *k = lval_sym("argv");
+	lenv_let(env, k, args);
+	lval_del(k);
+	lval_del(args);
+
+	int status = 0;
+	if (sock != NULL) {
+		/*
+		 * Any script or expressions warm the environment up first,
+		 * and only what clients send is limited
+		 */
+		if (nexprs > 0 || script != NULL)
+			status = batch(env, exprs, nexprs, script);
+		if (status == 0)
+			status = serve(env, sock);
+	} else if (nexprs > 0 || script != NULL || !isatty(STDIN_FILENO)) {
+		/* The limits are for the whole script */
+		lquota_swap(limits());
+		status = batch(env, exprs, nexprs, script);
+		lquota_release(lquota_swap(NULL));
+	} else {
+		repl(env);
 	}
 
-	/* Undefine and delete our parsers */
-	mpc_cleanup(5, Number, Symbol, Expr, SExpr, MyLisp);
-	return 0;
+	free(exprs);
+	reader_cleanup();
+	return status;
 }
@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+
+#include "mpc.h"
+#include "reader.h"
+#include "reader_tables.h"
+
+/*
+ * The parsers below are equivalent to this grammar passed to mpca_lang, and
+ * produce the same ASTs:
+ *
+ *	number   : /-?[0-9.]+/ ;
+ *	symbol   : /[a-zA-Z0-9_+\-*\/\\=<>!%^&]+/ ;
+ *	string   : /"(\\.|[^"\\])*"/ ;
+ *	expr     : <number> | <symbol> | <string> | <sexpr> ;
+ *	sexpr    : '(' <expr>* ')' ;
+ *	mylisp   : /^/ <sexpr> /$/ ;
+ *	program  : /^/ <sexpr>* /$/ ;
+ *
+ * The REPL reads one form at a time with mylisp, and whole files are read
+ * with program.
+ *
+ * TODO(jfriedly):  Implement concepts of unary, binary, etc. symbols.
+ * For example, (/ 1) should be a syntax error.
+ */
+static mpc_parser_t *Number;
+static mpc_parser_t *Symbol;
+static mpc_parser_t *String;
+static mpc_parser_t *Expr;
+static mpc_parser_t *SExpr;
+static mpc_parser_t *MyLisp;
+static mpc_parser_t *Program;
+
+/* A regex or char in the grammar, as mpca_lang would wrap it */
+static mpc_parser_t *reader_token(mpc_parser_t *p, const char *tag)
+{
+	return mpca_state(mpca_tag(mpc_apply(mpc_tok(p), mpcf_str_ast), tag));
+}
+
+/* A reference to another rule in the grammar, i.e. <name> */
+static mpc_parser_t *reader_rule(mpc_parser_t *p, const char *name)
+{
+	return mpca_state(mpca_root(mpca_add_tag(p, name)));
+}
+
+/* The /^/ and /$/ anchors, which match but consume nothing */
+static mpc_parser_t *reader_anchor(mpc_parser_t *anchor)
+{
+	return reader_token(mpc_and(2, mpcf_snd, anchor,
+		mpc_lift(mpcf_ctor_str), free), "regex");
+}
+
+/*
+ * A string literal, quotes and escapes included.  The runs of characters
+ * between escapes are matched by a DFA, so a string without escapes is only
+ * a few parsers deep.
+ */
+static mpc_parser_t *reader_string(void)
+{
+	mpc_parser_t *chars = mpc_dfa(reader_string_chars_n,
+		reader_string_chars_quants, reader_string_chars_table);
+	mpc_parser_t *body = mpc_many(mpcf_strfold,
+		mpc_or(2, chars, mpc_escape()));
+	return mpc_expect(mpc_and(3, mpcf_strfold, mpc_char('"'), body,
+		mpc_char('"'), free, free), "/\"(\\\\.|[^\"\\\\])*\"/");
+}
+
+void reader_init(void)
+{
+	Number = mpc_new("number");
+	Symbol = mpc_new("symbol");
+	String = mpc_new("string");
+	Expr   = mpc_new("expr");
+	SExpr  = mpc_new("sexpr");
+	MyLisp = mpc_new("mylisp");
+	Program = mpc_new("program");
+
+	mpc_define(Number, reader_token(mpc_expectf(mpc_dfa(reader_number_n,
+		reader_number_quants, reader_number_table), "/%s/",
+		reader_number_re), "regex"));
+	mpc_define(Symbol, reader_token(mpc_expectf(mpc_dfa(reader_symbol_n,
+		reader_symbol_quants, reader_symbol_table), "/%s/",
+		reader_symbol_re), "regex"));
+	mpc_define(String, reader_token(reader_string(), "regex"));
+	mpc_define(Expr, mpca_or(4,
+		reader_rule(Number, "number"),
+		reader_rule(Symbol, "symbol"),
+		reader_rule(String, "string"),
+		reader_rule(SExpr, "sexpr")));
+	mpc_define(SExpr, mpca_and(3,
+		reader_token(mpc_char('('), "char"),
+		mpca_many(reader_rule(Expr, "expr")),
+		reader_token(mpc_char(')'), "char")));
+	mpc_define(MyLisp, mpca_and(3,
+		reader_anchor(mpc_soi()),
+		reader_rule(SExpr, "sexpr"),
+		reader_anchor(mpc_eoi())));
+	mpc_define(Program, mpca_and(3,
+		reader_anchor(mpc_soi()),
+		mpca_many(reader_rule(SExpr, "sexpr")),
+		reader_anchor(mpc_eoi())));
+}
+
+void reader_cleanup(void)
+{
+	mpc_cleanup(7, Number, Symbol, String, Expr, SExpr, MyLisp, Program);
+}
+
+mpc_ast_t *reader_parse(mpc_arena_t *arena, char *input)
+{
+	mpc_result_t r;
+	debug("Parsing...");
+	if (!mpc_parse_arena("<stdin>", input, MyLisp, arena, &r)) {
+		log_err("Failed to parse expression:");
+		mpc_err_print(r.error);
+		mpc_err_delete(r.error);
+		return NULL;
+	}
+	debug("Parsed into an AST successfully.");
+	return r.output;
+}
+
+/* Parse a program that starts on the given (zero based) line of a file */
+static mpc_ast_t *reader_parse_lines(mpc_arena_t *arena, const char *filename,
+	char *input, long line, char **error)
+{
+	mpc_result_t r;
+	if (!mpc_parse_arena(filename, input, Program, arena, &r)) {
+		r.error->state.row += line;
+		*error = mpc_err_string(r.error);
+		mpc_err_delete(r.error);
+		return NULL;
+	}
+	return r.output;
+}
+
+mpc_ast_t *reader_parse_program(mpc_arena_t *arena, const char *filename,
+	char *input, char **error)
+{
+	return reader_parse_lines(arena, filename, input, 0, error);
+}
+
+struct reader *reader_new(void)
+{
+	struct reader *r = malloc(sizeof(struct reader));
+	r->cap = 256;
+	r->buf = malloc(r->cap);
+	r->buf[0] = '\0';
+	r->len = 0;
+	r->depth = 0;
+	r->started = false;
+	r->quoted = false;
+	r->escaped = false;
+	r->line = 0;
+	r->newlines = 0;
+	return r;
+}
+
+void reader_del(struct reader *r)
+{
+	free(r->buf);
+	free(r);
+}
+
+void reader_write(struct reader *r, const char *s, size_t n)
+{
+	size_t start = r->len;
+
+	/* Grow geometrically so that appending stays amortized O(1) per byte */
+	if (r->len + n + 1 > r->cap) {
+		while (r->len + n + 1 > r->cap)
+			r->cap *= 2;
+		r->buf = realloc(r->buf, r->cap);
+	}
+	memcpy(r->buf + r->len, s, n);
+	r->len += n;
+	r->buf[r->len] = '\0';
+
+	/* Only scan the bytes that were just added */
+	for (size_t i = start; i < r->len; i++) {
+		/* Parens don't count inside a string, but newlines do */
+		if (r->quoted) {
+			if (r->escaped)
+				r->escaped = false;
+			else if (r->buf[i] == '\\')
+				r->escaped = true;
+			else if (r->buf[i] == '"')
+				r->quoted = false;
+			if (r->buf[i] == '\n')
+				r->newlines++;
+			continue;
+		}
+		switch (r->buf[i]) {
+		case '(':
+			r->depth++;
+			r->started = true;
+			break;
+		case ')':
+			r->depth--;
+			r->started = true;
+			break;
+		case '"':
+			r->quoted = true;
+			r->started = true;
+			break;
+		case '\n':
+			r->newlines++;
+			break;
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\f':
+		case '\v':
+			break;
+		default:
+			r->started = true;
+			break;
+		}
+	}
+}
+
+void reader_feed(struct reader *r, char *line)
+{
+	reader_write(r, line, strlen(line));
+	reader_write(r, "\n", 1);
+}
+
+bool reader_empty(struct reader *r)
+{
+	return !r->started;
+}
+
+bool reader_complete(struct reader *r)
+{
+	return r->started && r->depth <= 0 && !r->quoted;
+}
+
+/* Empty the reader once its buffer has been parsed */
+static void reader_reset(struct reader *r)
+{
+	r->len = 0;
+	r->buf[0] = '\0';
+	r->depth = 0;
+	r->started = false;
+	r->quoted = false;
+	r->escaped = false;
+	r->line += r->newlines;
+	r->newlines = 0;
+}
+
+mpc_ast_t *reader_read(struct reader *r, mpc_arena_t *arena)
+{
+	mpc_ast_t *ast = reader_parse(arena, r->buf);
+	reader_reset(r);
+	return ast;
+}
+
+mpc_ast_t *reader_read_program(struct reader *r, mpc_arena_t *arena,
+	const char *filename, char **error)
+{
+	mpc_ast_t *ast = reader_parse_lines(arena, filename, r->buf, r->line,
+		error);
+	reader_reset(r);
+	return ast;
+}
@@ -0,0 +1,92 @@
+#ifndef reader_h
+#define reader_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mpc.h"
+
+/*
+ * The reader turns source text into an mpc AST for lval_read.
+ *
+ * Its parsers are built directly from combinators and the precompiled regex
+ * tables in reader_tables.h, so reader_init does no grammar or regex parsing.
+ */
+/*
+ * Bump this whenever a change to the grammar or to lval_read changes what
+ * any source text reads as, so that forms cached by load are read again.
+ */
+#define READER_VERSION 1
+
+void reader_init(void);
+void reader_cleanup(void);
+
+/*
+ * Attempt to parse the user input.  The AST is allocated from the arena and
+ * is freed by resetting the arena, not by mpc_ast_delete.  Returns NULL and
+ * prints the error if the input doesn't parse.
+ */
+mpc_ast_t *reader_parse(mpc_arena_t *arena, char *input);
+
+/*
+ * Parse a whole file of any number of forms, under the same rules as
+ * reader_parse.  On failure NULL is returned and *error is set to the error
+ * message, which must be freed.
+ */
+mpc_ast_t *reader_parse_program(mpc_arena_t *arena, const char *filename,
+	char *input, char **error);
+
+/*
+ * An incremental reader for the REPL.
+ *
+ * Lines are fed in one at a time and appended to a buffer until they make
+ * up a whole form.  Only the newly added bytes are scanned to keep track of
+ * the paren depth and whether they end inside a string, and the form is
+ * parsed once when it's complete, so reading a form spread over n lines
+ * takes time linear in its length.
+ */
+struct reader {
+	char *buf;
+	size_t len;
+	size_t cap;
+	int depth;
+	bool started;
+	/* Inside a string literal, and just after a backslash in one */
+	bool quoted;
+	bool escaped;
+	/* Lines read before the buffered input, and newlines within it */
+	long line;
+	long newlines;
+};
+
+/* Incremental reader constructor and destructor */
+struct reader *reader_new(void);
+void reader_del(struct reader *r);
+
+/* Append a line (without its trailing newline) to the reader */
+void reader_feed(struct reader *r, char *line);
+
+/* Append n bytes of raw input to the reader, newlines included */
+void reader_write(struct reader *r, const char *s, size_t n);
+
+/* True if nothing but whitespace has been fed since the last read */
+bool reader_empty(struct reader *r);
+
+/* True once the parens in the buffered input balance, outside a string */
+bool reader_complete(struct reader *r);
+
+/*
+ * Parse the buffered form and empty the reader.  The AST follows the same
+ * rules as reader_parse.
+ */
+mpc_ast_t *reader_read(struct reader *r, mpc_arena_t *arena);
+
+/*
+ * Parse the buffered input as any number of forms, as reader_parse_program
+ * does, and empty the reader.  Errors give line numbers counted from the
+ * first line ever fed to the reader.
+ */
+mpc_ast_t *reader_read_program(struct reader *r, mpc_arena_t *arena,
+	const char *filename, char **error);
+
+#endif
@@ -0,0 +1,119 @@
+/* Generated by genreader.c.  Do not edit. */
+#ifndef reader_tables_h
+#define reader_tables_h
+
+static const char reader_number_re[] = "-?[0-9.]+";
+static const int reader_number_n = 2;
+static const char reader_number_quants[] = { '?', '+', 0 };
+static const unsigned int reader_number_table[256] = {
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x1, 0x2, 0x0,
+  0x2, 0x2, 0x2, 0x2, 0x2, 0x2, 0x2, 0x2,
+  0x2, 0x2, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+};
+
+static const char reader_symbol_re[] = "[a-zA-Z0-9_+\\-*/\\\\=<>!%^&]+";
+static const int reader_symbol_n = 1;
+static const char reader_symbol_quants[] = { '+', 0 };
+static const unsigned int reader_symbol_table[256] = {
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x1, 0x0, 0x0, 0x0, 0x1, 0x1, 0x0,
+  0x0, 0x0, 0x1, 0x1, 0x0, 0x1, 0x0, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x0, 0x0, 0x1, 0x1, 0x1, 0x0,
+  0x0, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x0, 0x1, 0x0, 0x1, 0x1,
+  0x0, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+};
+
+static const char reader_string_chars_re[] = "[^\"\\\\]+";
+static const int reader_string_chars_n = 1;
+static const char reader_string_chars_quants[] = { '+', 0 };
+static const unsigned int reader_string_chars_table[256] = {
+  0x0, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x0, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x0, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+  0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1, 0x1,
+};
+
+#endif
@@ -0,0 +1,6 @@
+(set (quote c) (channel 4))
+(set (quote fu) (future (quote (recv c))))
+(sleep 50)
+(pmap (lambda (quote (x)) (quote (+ x 1))) (list 1 2 3 4))
+(send c 42)
+(touch fu)
@@ -0,0 +1,37 @@
+(set (quote xs) (list 0))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote n) (length xs))
+(set (quote xs) (join xs (pmap (lambda (quote (x)) (quote (+ x n))) xs)))
+(set (quote h) (hashmap))
+(length (pmap (lambda (quote (x)) (quote (put h x x))) xs))
+(length (entries h))
+(get h 65535)
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Run every script in tests/ and compare what it prints with the .out file
+# next to it.  Each one runs on pools of 2 and 4 threads, and fails if it
+# takes more than 10 seconds, since some of the bugs they cover hang.
+#
+# Usage: tests/run.sh [mylisp]
+
+mylisp=${1:-build/mylisp}
+dir=$(dirname "$0")
+failed=0
+
+for script in "$dir"/*.lisp; do
+	for t in 2 4; do
+		if MYLISP_THREADS=$t timeout 10 "$mylisp" "$script" 2>&1 |
+			cmp -s - "${script%.lisp}.out"; then
+			echo "ok    $script ($t threads)"
+		else
+			echo "FAIL  $script ($t threads)"
+			failed=1
+		fi
+	done
+done
+exit $failed